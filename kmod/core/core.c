@@ -70,8 +70,11 @@ void kpatch_backtrace_address_verify(void *data, unsigned long address,
 	for (i = 0; i < num_funcs; i++) {
 		struct kpatch_func *func = &funcs[i];
 
-		if (address >= func->old_addr &&
-		    address < func->old_addr + func->old_size) {
+		/* the cold part of a function jumps back into it */
+		if ((address >= func->old_addr &&
+		     address < func->old_addr + func->old_size) ||
+		    (address >= func->old_cold_addr &&
+		     address < func->old_cold_addr + func->old_cold_size)) {
 			printk("kpatch: activeness safety check failed for "
 			       "function at address " "'%lx()'\n",
 			       func->old_addr);
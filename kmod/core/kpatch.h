@@ -31,6 +31,8 @@ struct kpatch_func {
 	unsigned long new_addr;
 	unsigned long old_addr;
 	unsigned long old_size;
+	unsigned long old_cold_addr;
+	unsigned long old_cold_size;
 	struct module *mod;
 	struct hlist_node node;
 };
@@ -45,6 +45,8 @@ static int __init patch_init(void)
 	for (i = 0; i < num_funcs; i++) {
 		funcs[i].old_addr = patches[i].old_addr;
 		funcs[i].old_size = patches[i].old_size;
+		funcs[i].old_cold_addr = patches[i].old_cold_addr;
+		funcs[i].old_cold_size = patches[i].old_cold_size;
 		funcs[i].new_addr = patches[i].new_addr;
 	}
 
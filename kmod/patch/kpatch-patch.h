@@ -28,6 +28,8 @@ struct kpatch_patch {
 	unsigned long new_addr;
 	unsigned long old_addr;
 	unsigned long old_size;
+	unsigned long old_cold_addr;
+	unsigned long old_cold_size;
 };
 
 #endif /* _KPATCH_PATCH_H_ */
@@ -0,0 +1,46 @@
+/*
+ * create-symbol-index.c
+ *
+ * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+/*
+ * This tool takes the base vmlinux, or a System.map or kallsyms listing of
+ * its symbols, and writes out its symbol index, which kpatch-link can map
+ * instead of reading the vmlinux.
+ */
+
+#include <stdio.h>
+#include <error.h>
+
+#include "symindex.h"
+
+int main(int argc, char **argv)
+{
+	struct symindex index;
+
+	if (argc != 3)
+		error(1, 0, "usage: %s vmlinux|symbol-map index", argv[0]);
+
+	symindex_open(argv[1], &index);
+	symindex_write(&index, argv[2]);
+	printf("%u symbols\n", index.header->syms_nr);
+	symindex_close(&index);
+
+	return 0;
+}
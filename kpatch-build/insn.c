@@ -0,0 +1,223 @@
+/*
+ * insn.c
+ *
+ * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+/*
+ * A table driven x86_64 instruction length decoder.  It only works out
+ * where the parts of an instruction are, not what it does: the prefixes,
+ * the opcode, the ModRM and SIB bytes, the displacement and the immediate.
+ */
+
+#include <string.h>
+
+#include "insn.h"
+
+/* operand layout flags for each opcode */
+#define M	0x01	/* ModRM */
+#define B	0x02	/* 8 bit immediate */
+#define W	0x04	/* 16 bit immediate */
+#define Z	0x08	/* 16 or 32 bit immediate, by operand size */
+#define V	0x10	/* 16, 32 or 64 bit immediate, by operand size */
+#define A	0x20	/* address sized immediate (moffs) */
+#define G	0x40	/* immediate with ModRM reg 0 or 1 only (group 3) */
+#define X	0x80	/* invalid, or a prefix handled elsewhere */
+
+static const unsigned char onebyte[256] = {
+	/* 00 */ M, M, M, M, B, Z, X, X, M, M, M, M, B, Z, X, X,
+	/* 10 */ M, M, M, M, B, Z, X, X, M, M, M, M, B, Z, X, X,
+	/* 20 */ M, M, M, M, B, Z, X, X, M, M, M, M, B, Z, X, X,
+	/* 30 */ M, M, M, M, B, Z, X, X, M, M, M, M, B, Z, X, X,
+	/* 40 */ X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+	/* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* 60 */ X, X, X, M, X, X, X, X, Z, M|Z, B, M|B, 0, 0, 0, 0,
+	/* 70 */ B, B, B, B, B, B, B, B, B, B, B, B, B, B, B, B,
+	/* 80 */ M|B, M|Z, X, M|B, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, X, 0, 0, 0, 0, 0,
+	/* a0 */ A, A, A, A, 0, 0, 0, 0, B, Z, 0, 0, 0, 0, 0, 0,
+	/* b0 */ B, B, B, B, B, B, B, B, V, V, V, V, V, V, V, V,
+	/* c0 */ M|B, M|B, W, 0, X, X, M|B, M|Z, W|B, 0, W, 0, 0, B, X, 0,
+	/* d0 */ M, M, M, M, X, X, X, 0, M, M, M, M, M, M, M, M,
+	/* e0 */ B, B, B, B, B, B, B, B, Z, Z, X, B, 0, 0, 0, 0,
+	/* f0 */ X, 0, X, X, 0, 0, M|G, M|G, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+static const unsigned char twobyte[256] = {
+	/* 00 */ M, M, M, M, X, 0, 0, 0, 0, 0, X, 0, X, M, 0, M|B,
+	/* 10 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 20 */ M, M, M, M, X, X, X, X, M, M, M, M, M, M, M, M,
+	/* 30 */ 0, 0, 0, 0, 0, 0, X, 0, X, X, X, X, X, X, X, X,
+	/* 40 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 50 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 60 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* 70 */ M|B, M|B, M|B, M|B, M, M, M, 0, M, M, M, M, M, M, M, M,
+	/* 80 */ Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z,
+	/* 90 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* a0 */ 0, 0, 0, M, M|B, M, X, X, 0, 0, 0, M, M|B, M, M, M,
+	/* b0 */ M, M, M, M, M, M, M, M, M, M, M|B, M, M, M, M, M,
+	/* c0 */ M, M, M|B, M, M|B, M|B, M|B, M, 0, 0, 0, 0, 0, 0, 0, 0,
+	/* d0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* e0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+	/* f0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+
+/* the opcodes of the 0f map with an immediate under VEX and EVEX too */
+static int vex_has_imm(unsigned char map, unsigned char opcode)
+{
+	if (map == INSN_MAP_0F3A)
+		return 1;
+	return map == INSN_MAP_0F &&
+	       ((opcode >= 0x70 && opcode <= 0x73) || opcode == 0xc2 ||
+		(opcode >= 0xc4 && opcode <= 0xc6));
+}
+
+int insn_decode(struct insn *insn, const unsigned char *buf, size_t size)
+{
+	size_t pos = 0, max = size < 15 ? size : 15;
+	int opsize16 = 0, addrsize32 = 0;
+	unsigned char flags, mod, rm;
+
+	memset(insn, 0, sizeof(*insn));
+
+	/* legacy prefixes */
+	for (; pos < max; pos++) {
+		switch (buf[pos]) {
+		case 0x66:
+			opsize16 = 1;
+			continue;
+		case 0x67:
+			addrsize32 = 1;
+			continue;
+		case 0xf0: case 0xf2: case 0xf3:
+		case 0x26: case 0x2e: case 0x36: case 0x3e:
+		case 0x64: case 0x65:
+			continue;
+		}
+		break;
+	}
+	insn->prefixes = pos;
+
+	if (pos < max && (buf[pos] & 0xf0) == 0x40)
+		insn->rex = buf[pos++];
+	if (pos >= max)
+		return -1;
+
+	if (buf[pos] == 0xc4 || buf[pos] == 0xc5 || buf[pos] == 0x62) {
+		/* VEX and EVEX, which can't follow REX */
+		if (insn->rex)
+			return -1;
+		insn->vex = 1;
+		if (buf[pos] == 0xc5) {
+			insn->map = INSN_MAP_0F;
+			pos += 2;
+		} else if (buf[pos] == 0xc4) {
+			if (pos + 1 >= max)
+				return -1;
+			insn->map = buf[pos + 1] & 0x1f;
+			pos += 3;
+		} else {
+			if (pos + 1 >= max)
+				return -1;
+			insn->map = buf[pos + 1] & 0x3;
+			pos += 4;
+		}
+		if (insn->map < INSN_MAP_0F || insn->map > INSN_MAP_0F3A ||
+		    pos >= max)
+			return -1;
+		insn->opcode = buf[pos++];
+		/* vzeroupper and vzeroall have no operands */
+		flags = insn->map == INSN_MAP_0F && insn->opcode == 0x77 ? 0 : M;
+		if (vex_has_imm(insn->map, insn->opcode))
+			flags |= B;
+	} else if (buf[pos] == 0x0f) {
+		if (++pos >= max)
+			return -1;
+		if (buf[pos] == 0x38 || buf[pos] == 0x3a) {
+			insn->map = buf[pos] == 0x38 ? INSN_MAP_0F38 :
+				    INSN_MAP_0F3A;
+			if (++pos >= max)
+				return -1;
+			insn->opcode = buf[pos++];
+			flags = M | (insn->map == INSN_MAP_0F3A ? B : 0);
+		} else {
+			insn->map = INSN_MAP_0F;
+			insn->opcode = buf[pos++];
+			flags = twobyte[insn->opcode];
+			/* 3DNow! has its opcode in an immediate */
+			if (insn->opcode == 0x0f)
+				flags = M | B;
+		}
+	} else {
+		insn->map = INSN_MAP_ONEBYTE;
+		insn->opcode = buf[pos++];
+		flags = onebyte[insn->opcode];
+	}
+	if (flags & X)
+		return -1;
+
+	if (flags & M) {
+		if (pos >= max)
+			return -1;
+		insn->has_modrm = 1;
+		insn->modrm = buf[pos++];
+		mod = insn->modrm >> 6;
+		rm = insn->modrm & 7;
+
+		if (mod != 3 && rm == 4) {
+			if (pos >= max)
+				return -1;
+			insn->has_sib = 1;
+			insn->sib = buf[pos++];
+			if (mod == 0 && (insn->sib & 7) == 5)
+				insn->disp_size = 4;
+		}
+		if (mod == 0 && rm == 5)
+			insn->disp_size = 4;
+		else if (mod == 1)
+			insn->disp_size = 1;
+		else if (mod == 2)
+			insn->disp_size = 4;
+		insn->disp_offset = pos;
+		pos += insn->disp_size;
+
+		/* only test in group 3 has an immediate */
+		if ((flags & G) && ((insn->modrm >> 3) & 7) < 2)
+			flags |= insn->opcode == 0xf6 ? B : Z;
+	}
+
+	insn->imm_offset = pos;
+	if (flags & W)
+		insn->imm_size += 2;
+	if (flags & B)
+		insn->imm_size += 1;
+	if (flags & Z)
+		insn->imm_size += opsize16 ? 2 : 4;
+	if (flags & V)
+		insn->imm_size += (insn->rex & INSN_REX_W) ? 8 :
+				  opsize16 ? 2 : 4;
+	if (flags & A)
+		insn->imm_size += addrsize32 ? 4 : 8;
+	pos += insn->imm_size;
+
+	if (pos > max)
+		return -1;
+	insn->length = pos;
+
+	return 0;
+}
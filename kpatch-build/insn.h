@@ -0,0 +1,63 @@
+/*
+ * insn.h
+ *
+ * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ *
+ * Decoding of x86_64 instruction lengths and operand layout, enough to
+ * walk the instructions of a function and find its branches and
+ * immediates.
+ */
+
+#ifndef _KPATCH_INSN_H_
+#define _KPATCH_INSN_H_
+
+#include <stddef.h>
+
+/* opcode maps */
+#define INSN_MAP_ONEBYTE	0
+#define INSN_MAP_0F		1
+#define INSN_MAP_0F38		2
+#define INSN_MAP_0F3A		3
+
+/* REX prefix bits */
+#define INSN_REX_W		0x8
+#define INSN_REX_R		0x4
+#define INSN_REX_X		0x2
+#define INSN_REX_B		0x1
+
+struct insn {
+	unsigned char length;
+	unsigned char prefixes;		/* number of legacy prefixes */
+	unsigned char rex;		/* REX prefix, or 0 */
+	unsigned char vex;		/* VEX or EVEX encoded */
+	unsigned char map;
+	unsigned char opcode;
+	unsigned char has_modrm, modrm;
+	unsigned char has_sib, sib;
+	unsigned char disp_offset, disp_size;
+	unsigned char imm_offset, imm_size;	/* rel8/rel32 of branches too */
+};
+
+/*
+ * Decode the instruction at the start of buf, which has size bytes.
+ * Returns 0, or -1 if the bytes aren't a valid instruction in 64-bit mode
+ * or it doesn't fit.
+ */
+int insn_decode(struct insn *insn, const unsigned char *buf, size_t size);
+
+#endif /* _KPATCH_INSN_H_ */
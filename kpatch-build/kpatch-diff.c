@@ -0,0 +1,4034 @@
+/*
+ * kpatch-diff.c
+ *
+ * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
+ * Copyright (C) 2013 Josh Poimboeuf <jpoimboe@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+/*
+ * This file contains the heart of the ELF object differencing engine.
+ *
+ * The engine takes two ELF objects from two versions of the same source
+ * file; a "base" object and a "patched" object, as in-memory images.
+ *
+ * The engine compares the objects at a section level to determine what
+ * sections have changed.  Once a list of changed sections has been generated,
+ * various rules are applied to determine any object local sections that
+ * are dependencies of the changed section and also need to be included in
+ * the output object.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <gelf.h>
+
+#include "kpatch-diff.h"
+#include "insn.h"
+
+#define ERROR(format, ...) \
+	kpatch_diff_error(KPATCH_DIFF_ERROR, "%s: %d: " format, \
+			  __FUNCTION__, __LINE__, ##__VA_ARGS__)
+
+#define DIFF_FATAL(format, ...) \
+	kpatch_diff_error(KPATCH_DIFF_FATAL, "%s:%d: " format, \
+			  __FUNCTION__, __LINE__, ##__VA_ARGS__)
+
+#define log_debug(format, ...) log(DEBUG, format, ##__VA_ARGS__)
+#define log_normal(format, ...) log(NORMAL, format, ##__VA_ARGS__)
+
+#define log(level, format, ...) \
+({ \
+	if (loglevel <= (level)) \
+		fprintf(logfile, format, ##__VA_ARGS__); \
+})
+
+
+enum loglevel {
+	DEBUG,
+	NORMAL,
+	QUIET
+};
+
+/*
+ * The engine's state is per thread, so separate threads can diff objects
+ * at the same time.
+ */
+static __thread enum loglevel loglevel = NORMAL;
+static __thread FILE *logfile;
+
+/*
+ * Everything the engine allocates while diffing comes from an arena which
+ * is freed as a whole when kpatch_diff() returns, so bailing out of the
+ * middle of a diff with ERROR() or DIFF_FATAL() doesn't leak.
+ */
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;
+	char data[] __attribute__((aligned(16)));
+};
+
+struct kpatch_diff_state {
+	jmp_buf env;
+	struct kpatch_diff_result *result;
+	struct arena_chunk *arena;
+	Elf *elfs[3];
+	int elfs_nr;
+	int fd;
+	FILE *inventory, *report;
+};
+
+static __thread struct kpatch_diff_state *state;
+
+static void kpatch_diff_error(int status, const char *format, ...)
+	__attribute__((noreturn, format(printf, 2, 3)));
+
+static void kpatch_diff_error(int status, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(state->result->error, sizeof(state->result->error),
+		  format, args);
+	va_end(args);
+
+	longjmp(state->env, status);
+}
+
+void *kpatch_alloc(size_t size)
+{
+	struct arena_chunk *chunk = state->arena;
+
+	size = (size + 15) & ~15UL;
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk = calloc(1, sizeof(*chunk) +
+			       (size > ARENA_CHUNK_SIZE ? size :
+				ARENA_CHUNK_SIZE));
+		if (!chunk)
+			ERROR("calloc");
+		chunk->size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+		/* keep filling the current chunk after a big allocation */
+		if (state->arena && size > ARENA_CHUNK_SIZE) {
+			chunk->next = state->arena->next;
+			state->arena->next = chunk;
+		} else {
+			chunk->next = state->arena;
+			state->arena = chunk;
+		}
+	}
+
+	chunk->used += size;
+	return chunk->data + chunk->used - size;
+}
+
+char *kpatch_strndup(const char *str, size_t len)
+{
+	char *copy;
+
+	len = strnlen(str, len);
+	copy = kpatch_alloc(len + 1);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+
+	return copy;
+}
+
+char *kpatch_strdup(const char *str)
+{
+	return kpatch_strndup(str, strlen(str));
+}
+
+void kpatch_diff_cleanup(void)
+{
+	struct arena_chunk *chunk, *next;
+
+	if (state->inventory)
+		fclose(state->inventory);
+	if (state->report)
+		fclose(state->report);
+	while (state->elfs_nr)
+		elf_end(state->elfs[--state->elfs_nr]);
+	if (state->fd != -1)
+		close(state->fd);
+	for (chunk = state->arena; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	state = NULL;
+}
+
+/*******************
+ * Data structures
+ * ****************/
+struct section;
+struct symbol;
+struct rela;
+
+enum status {
+	NEW,
+	CHANGED,
+	SAME
+};
+
+struct table {
+	void *data;
+	size_t nr;
+};
+
+struct section {
+	struct section *twin, *twino;
+	GElf_Shdr sh;
+	Elf_Data *data;
+	char *name;
+	int index;
+	enum status status;
+	int include;
+	int rank;
+	union {
+		struct { /* if (is_rela_section()) */
+			struct section *base;
+			struct table relas;
+		};
+		struct { /* else */
+			struct section *rela;
+			struct symbol *secsym, *sym;
+		};
+	};
+};
+
+struct symbol {
+	struct symbol *twin, *twino;
+	struct symbol *parent, *child;
+	struct section *sec;
+	GElf_Sym sym;
+	char *name;
+	int index;
+	unsigned char bind, type;
+	enum status status;
+	int include;
+};
+
+struct rela {
+	struct rela *twin;
+	GElf_Rela rela;
+	struct symbol *sym;
+	unsigned char type;
+	int addend;
+	int offset;
+	char *string;
+	enum status status;
+};
+
+#define for_each_entry(iter, entry, table, type) \
+	for (iter = 0; (iter) < (table)->nr && ((entry) = &((type)(table)->data)[iter]); (iter)++)
+
+#define for_each_section(iter, entry, table) \
+	for_each_entry(iter, entry, table, struct section *)
+#define for_each_symbol(iter, entry, table) \
+	for_each_entry(iter, entry, table, struct symbol *)
+#define for_each_rela(iter, entry, table) \
+	for_each_entry(iter, entry, table, struct rela *)
+
+struct kpatch_elf {
+	Elf *elf;
+	int native;
+	struct table sections;
+	struct table symbols;
+};
+
+/*******************
+ * Helper functions
+ ******************/
+
+char *status_str(enum status status)
+{
+	switch(status) {
+	case NEW:
+		return "NEW";
+	case CHANGED:
+		return "CHANGED";
+	case SAME:
+		return "SAME";
+	default:
+		ERROR("status_str");
+	}
+	/* never reached */
+	return NULL;
+}
+
+int is_rela_section(struct section *sec)
+{
+	return (sec->sh.sh_type == SHT_RELA);
+}
+
+struct section *find_section_by_index(struct table *table, unsigned int index)
+{
+	struct section *sec;
+	int i;
+
+	/* sections are normally stored in index order */
+	if (index > 0 && index <= table->nr) {
+		sec = &((struct section *)table->data)[index - 1];
+		if (sec->index == index)
+			return sec;
+	}
+
+	for_each_section(i, sec, table)
+		if (sec->index == index)
+			return sec;
+
+	return NULL;
+}
+
+struct section *find_section_by_name(struct table *table, const char *name)
+{
+	struct section *sec;
+	int i;
+
+	for_each_section(i, sec, table)
+		if (!strcmp(sec->name, name))
+			return sec;
+
+	return NULL;
+}
+
+struct symbol *find_symbol_by_index(struct table *table, size_t index)
+{
+	struct symbol *sym;
+	int i;
+
+	/* symbols are normally stored in index order */
+	if (index < table->nr) {
+		sym = &((struct symbol *)table->data)[index];
+		if (sym->index == index)
+			return sym;
+	}
+
+	for_each_symbol(i, sym, table)
+		if (sym->index == index)
+			return sym;
+
+	return NULL;
+}
+
+struct symbol *find_symbol_by_name(struct table *table, const char *name)
+{
+	struct symbol *sym;
+	int i;
+
+	for_each_symbol(i, sym, table)
+		if (sym->name && !strcmp(sym->name, name))
+			return sym;
+
+	return NULL;
+}
+
+void alloc_table(struct table *table, size_t entsize, size_t nr)
+{
+	size_t size = nr * entsize;
+
+	table->data = kpatch_alloc(size);
+	memset(table->data, 0, size);
+	table->nr = nr;
+}
+
+/*
+ * For ELF64 objects, the symbol and rela tables libelf hands back are
+ * arrays of the native structures, so they can be read in place rather
+ * than entry by entry through the gelf accessors.  Other objects, and
+ * tables which don't look as expected, fall back to gelf.
+ */
+int is_native_table(struct kpatch_elf *kelf, struct section *sec,
+		    Elf_Type type, size_t entsize)
+{
+	return kelf->native && sec->data->d_type == type &&
+	       sec->sh.sh_entsize == entsize &&
+	       sec->data->d_size == sec->sh.sh_size &&
+	       !((unsigned long)sec->data->d_buf % sizeof(Elf64_Xword));
+}
+
+/*
+ * Return a pointer to a string in a string table section, or NULL if the
+ * offset is out of bounds.  If the table is NUL terminated, the bounds
+ * check is all that's needed and the string can be used in place.
+ */
+char *kpatch_strptr(struct kpatch_elf *kelf, struct section *strsec,
+		    size_t offset)
+{
+	char *buf = strsec->data->d_buf;
+	size_t size = strsec->data->d_size;
+
+	if (kelf->native && size && !buf[size - 1])
+		return offset < size ? buf + offset : NULL;
+
+	return elf_strptr(kelf->elf, strsec->index, offset);
+}
+
+/*************
+ * Functions
+ * **********/
+/*
+ * Return the offset into the target section which a rela refers to.  The
+ * processor applies PC relative displacements in instructions from the end
+ * of the displacement, so the addend of such relas is biased by its size.
+ */
+long rela_target_offset(struct section *relasec, struct rela *rela)
+{
+	if ((relasec->base->sh.sh_flags & SHF_EXECINSTR) &&
+	    (rela->type == R_X86_64_PC32 || rela->type == R_X86_64_PLT32))
+		return rela->addend + 4;
+
+	return rela->addend;
+}
+
+void kpatch_create_rela_table(struct kpatch_elf *kelf, struct section *sec)
+{
+	int rela_nr, i, native;
+	long offset;
+	struct rela *rela;
+	unsigned int symndx;
+
+	/* find matching base (text/data) section */
+	sec->base = find_section_by_index(&kelf->sections, sec->sh.sh_info);
+	if (!sec->base)
+		ERROR("can't find base section for rela section %s", sec->name);
+
+	/* create reverse link from base section to this rela section */
+	sec->base->rela = sec;
+		
+	/* allocate rela table for section */
+	rela_nr = sec->sh.sh_size / sec->sh.sh_entsize;
+	alloc_table(&sec->relas, sizeof(struct rela), rela_nr);
+
+	log_debug("\n=== rela table for %s (%d entries) ===\n",
+		sec->base->name, rela_nr);
+
+	native = is_native_table(kelf, sec, ELF_T_RELA, sizeof(Elf64_Rela));
+
+	/* read and store the rela entries */
+	for_each_rela(i, rela, &sec->relas) {
+		if (native)
+			rela->rela = ((Elf64_Rela *)sec->data->d_buf)[i];
+		else if (!gelf_getrela(sec->data, i, &rela->rela))
+			ERROR("gelf_getrela");
+
+		rela->type = GELF_R_TYPE(rela->rela.r_info);
+		rela->addend = rela->rela.r_addend;
+		rela->offset = rela->rela.r_offset;
+		symndx = GELF_R_SYM(rela->rela.r_info);
+		rela->sym = find_symbol_by_index(&kelf->symbols, symndx);
+		if (!rela->sym)
+			ERROR("could not find rela entry symbol\n");
+		if (rela->sym->sec && (rela->sym->sec->sh.sh_flags & SHF_STRINGS)) {
+			offset = rela_target_offset(sec, rela);
+			if (offset >= 0 &&
+			    (size_t)offset < rela->sym->sec->data->d_size)
+				rela->string = rela->sym->sec->data->d_buf + offset;
+		}
+
+		log_debug("offset %d, type %d, %s %s %d", rela->offset,
+			rela->type, rela->sym->name,
+			(rela->addend < 0)?"-":"+", abs(rela->addend));
+		if (rela->string)
+			log_debug(" (string = %s)", rela->string);
+		log_debug("\n");
+	}
+}
+
+void kpatch_create_section_table(struct kpatch_elf *kelf)
+{
+	Elf_Scn *scn = NULL;
+	struct section *sec;
+	size_t shstrndx, sections_nr;
+	int i;
+
+	if (elf_getshdrnum(kelf->elf, &sections_nr))
+		ERROR("elf_getshdrnum");
+
+	/*
+	 * elf_getshdrnum() includes section index 0 but elf_nextscn
+	 * doesn't return that section so subtract one.
+	 */
+	sections_nr--;
+
+	alloc_table(&kelf->sections, sizeof(struct section), sections_nr);
+
+	if (elf_getshdrstrndx(kelf->elf, &shstrndx))
+		ERROR("elf_getshdrstrndx");
+
+	log_debug("=== section list (%zu) ===\n", sections_nr);
+
+	for_each_section(i, sec, &kelf->sections) {
+		scn = elf_nextscn(kelf->elf, scn);
+		if (!scn)
+			ERROR("scn NULL");
+
+		if (!gelf_getshdr(scn, &sec->sh))
+			ERROR("gelf_getshdr");
+
+		sec->name = elf_strptr(kelf->elf, shstrndx, sec->sh.sh_name);
+		if (!sec->name)
+			ERROR("elf_strptr");
+
+		sec->data = elf_getdata(scn, NULL);
+		if (!sec->data)
+			ERROR("elf_getdata");
+
+		sec->index = elf_ndxscn(scn);
+
+		log_debug("ndx %02d, data %p, size %zu, name %s\n",
+			sec->index, sec->data->d_buf, sec->data->d_size,
+			sec->name);
+	}
+
+	/* Sanity check, one more call to elf_nextscn() should return NULL */
+	if (elf_nextscn(kelf->elf, scn))
+		ERROR("expected NULL");
+}
+
+void kpatch_create_symbol_table(struct kpatch_elf *kelf)
+{
+	struct section *symtab, *shndx = NULL, *strtab, *sec;
+	struct symbol *sym;
+	int symbols_nr, i, native;
+	Elf32_Word xndx;
+	unsigned int secndx;
+
+	symtab = find_section_by_name(&kelf->sections, ".symtab");
+	if (!symtab)
+		ERROR("missing symbol table");
+
+	/*
+	 * Objects with more than SHN_LORESERVE sections store the section
+	 * indexes of their symbols in a separate table.
+	 */
+	for_each_section(i, sec, &kelf->sections) {
+		if (sec->sh.sh_type == SHT_SYMTAB_SHNDX &&
+		    sec->sh.sh_link == symtab->index) {
+			shndx = sec;
+			break;
+		}
+	}
+
+	strtab = find_section_by_index(&kelf->sections, symtab->sh.sh_link);
+	if (!strtab)
+		ERROR("missing string table");
+
+	native = is_native_table(kelf, symtab, ELF_T_SYM, sizeof(Elf64_Sym)) &&
+		 (!shndx || is_native_table(kelf, shndx, ELF_T_WORD,
+					    sizeof(Elf32_Word)));
+
+	symbols_nr = symtab->sh.sh_size / symtab->sh.sh_entsize;
+
+	alloc_table(&kelf->symbols, sizeof(struct symbol), symbols_nr);
+
+	log_debug("\n=== symbol table (%d entries) ===\n", symbols_nr);
+
+	/* iterator i declared in for_each_entry() macro */
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0) /* skip symbol 0 */
+			continue;
+		sym->index = i;
+
+		if (native) {
+			sym->sym = ((Elf64_Sym *)symtab->data->d_buf)[i];
+			if (shndx)
+				xndx = ((Elf32_Word *)shndx->data->d_buf)[i];
+		} else if (!gelf_getsymshndx(symtab->data,
+					     shndx ? shndx->data : NULL,
+					     i, &sym->sym, &xndx))
+			ERROR("gelf_getsymshndx");
+
+		sym->name = kpatch_strptr(kelf, strtab, sym->sym.st_name);
+		if (!sym->name)
+			ERROR("elf_strptr");
+
+		sym->type = GELF_ST_TYPE(sym->sym.st_info);
+		sym->bind = GELF_ST_BIND(sym->sym.st_info);
+
+		if (sym->sym.st_shndx == SHN_XINDEX)
+			secndx = xndx;
+		else if (sym->sym.st_shndx > SHN_UNDEF &&
+			 sym->sym.st_shndx < SHN_LORESERVE)
+			secndx = sym->sym.st_shndx;
+		else
+			secndx = SHN_UNDEF;
+
+		if (secndx != SHN_UNDEF) {
+			sym->sec = find_section_by_index(&kelf->sections,
+							 secndx);
+			if (!sym->sec)
+				ERROR("couldn't find section for symbol %s\n",
+					sym->name);
+
+			/*
+			 * __ksymtab_strings is a special case where the
+			 * compiler creates FUNC/OBJECT syms that refer
+			 * to offsets inside the __ksymtab_strings section
+			 * for kernel exported symbols.  We want to ignore
+			 * those.
+			 */
+			if ((sym->type == STT_FUNC ||
+			     sym->type == STT_OBJECT) &&
+			    strcmp(sym->sec->name, "__ksymtab_strings")) {
+				/*
+				 * Sections with symbols at other offsets are
+				 * split up by kpatch_split_sections().
+				 */
+				if (sym->sym.st_value == 0)
+					sym->sec->sym = sym;
+			} else if (sym->type == STT_SECTION) {
+				sym->sec->secsym = sym;
+				/* use the section name as the symbol name */
+				sym->name = sym->sec->name;
+			}
+		}
+
+		log_debug("sym %02d, type %d, bind %d, ndx %02d, name %s",
+			sym->index, sym->type, sym->bind, sym->sym.st_shndx,
+			sym->name);
+		if (sym->sec)
+			log_debug(" -> %s", sym->sec->name);
+		log_debug("\n");
+	}
+
+}
+
+
+/*
+ * Objects built without -ffunction-sections and -fdata-sections have many
+ * functions or objects in one section.  Such sections are split up into a
+ * virtual section per symbol, named as GCC would have named the section,
+ * e.g. ".text.foo", so they can be diffed and included one by one.  The
+ * relas of the section are moved to the virtual sections by offset, and
+ * relas anywhere which refer to a split section through its section symbol
+ * are changed to refer to the function or object symbol instead.  Whatever
+ * isn't covered by a symbol stays in the original section, with the split
+ * off parts zeroed out.
+ */
+struct split_range {
+	struct section *sec;	/* virtual section */
+	unsigned long start, end;
+	int relas_nr;
+};
+
+struct split_info {
+	struct split_range *ranges;
+	int nr;
+};
+
+int split_sym_cmp(const void *a, const void *b)
+{
+	struct symbol *sym1 = *(struct symbol **)a, *sym2 = *(struct symbol **)b;
+
+	if (sym1->sec->index != sym2->sec->index)
+		return sym1->sec->index - sym2->sec->index;
+	if (sym1->sym.st_value != sym2->sym.st_value)
+		return sym1->sym.st_value < sym2->sym.st_value ? -1 : 1;
+	if (sym1->sym.st_size != sym2->sym.st_size)
+		return sym1->sym.st_size > sym2->sym.st_size ? -1 : 1;
+	return sym1->index - sym2->index;
+}
+
+struct split_range *find_split_range(struct split_info *info,
+				     unsigned long offset)
+{
+	int lo = 0, hi = info->nr - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (offset < info->ranges[mid].start)
+			hi = mid - 1;
+		else if (offset >= info->ranges[mid].end)
+			lo = mid + 1;
+		else
+			return &info->ranges[mid];
+	}
+
+	return NULL;
+}
+
+struct section *kpatch_new_section(struct kpatch_elf *kelf,
+				   struct section *template, char *fmt,
+				   char *name1, char *name2)
+{
+	struct section *sec;
+
+	sec = &((struct section *)kelf->sections.data)[kelf->sections.nr];
+	*sec = *template;
+	sec->index = ++kelf->sections.nr;
+
+	sec->name = kpatch_alloc(strlen(fmt) + strlen(name1) + strlen(name2));
+	sprintf(sec->name, fmt, name1, name2);
+
+	sec->data = kpatch_alloc(sizeof(*sec->data));
+	*sec->data = *template->data;
+
+	return sec;
+}
+
+void kpatch_split_relas(struct kpatch_elf *kelf, struct section *sec,
+			struct split_info *info)
+{
+	struct section *relasec = sec->rela, *vrelasec;
+	struct split_range *range;
+	struct rela *rela, *vrela, *relas;
+	int i, kept = 0;
+
+	for_each_rela(i, rela, &relasec->relas) {
+		range = find_split_range(info, rela->offset);
+		if (range)
+			range->relas_nr++;
+	}
+
+	for (i = 0; i < info->nr; i++) {
+		range = &info->ranges[i];
+		if (!range->relas_nr)
+			continue;
+
+		vrelasec = kpatch_new_section(kelf, relasec, "%s%s", ".rela",
+					      range->sec->name);
+		vrelasec->base = range->sec;
+		range->sec->rela = vrelasec;
+		alloc_table(&vrelasec->relas, sizeof(struct rela),
+			    range->relas_nr);
+		vrelasec->relas.nr = 0;
+		vrelasec->sh.sh_size = range->relas_nr * relasec->sh.sh_entsize;
+		vrelasec->data->d_size = vrelasec->sh.sh_size;
+	}
+
+	/* move the relas, keeping the ones which aren't covered by a symbol */
+	relas = relasec->relas.data;
+	for_each_rela(i, rela, &relasec->relas) {
+		range = find_split_range(info, rela->offset);
+		if (!range) {
+			relas[kept++] = *rela;
+			continue;
+		}
+		vrelasec = range->sec->rela;
+		vrela = &((struct rela *)vrelasec->relas.data)[vrelasec->relas.nr++];
+		*vrela = *rela;
+		vrela->offset -= range->start;
+		vrela->rela.r_offset = vrela->offset;
+	}
+	relasec->relas.nr = kept;
+	relasec->sh.sh_size = kept * relasec->sh.sh_entsize;
+	relasec->data->d_size = relasec->sh.sh_size;
+}
+
+/*
+ * The assembler resolves calls and jumps between functions in the same
+ * section itself, without a rela.  Once the section is split up they're
+ * between sections, so turn them into relas, or the split off functions
+ * would be compared and included with displacements which only make sense
+ * in the original object.  The functions are walked instruction by
+ * instruction, so only real branches are found, and branches which
+ * already have a rela are skipped, their displacement being zero rather
+ * than a real one.  A branch out of a function which can't be turned into
+ * a rela, a short one or one to code outside the split off functions, or
+ * a function which can't be decoded, is an error.
+ */
+void kpatch_split_branches(struct kpatch_elf *kelf, struct section *sec,
+			   struct split_info *info)
+{
+	struct section *relasec = sec->rela, *template;
+	struct split_range *range, *target;
+	struct rela *rela, *relas;
+	struct insn insn;
+	unsigned char *buf = sec->data->d_buf;
+	unsigned long offset, disp, *branches;
+	long dest;
+	int32_t rel32;
+	char *covered;
+	int i, nr = 0;
+
+	covered = kpatch_alloc(sec->sh.sh_size);
+	memset(covered, 0, sec->sh.sh_size);
+	if (relasec)
+		for_each_rela(i, rela, &relasec->relas)
+			if ((unsigned long)rela->offset < sec->sh.sh_size)
+				covered[rela->offset] = 1;
+
+	/* at most one branch per 5 bytes */
+	branches = kpatch_alloc((sec->sh.sh_size / 5 + 1) * sizeof(*branches));
+
+	for (i = 0; i < info->nr; i++) {
+		range = &info->ranges[i];
+		if (range->sec->sym->type != STT_FUNC)
+			continue;
+		for (offset = range->start; offset < range->end;
+		     offset += insn.length) {
+			if (insn_decode(&insn, buf + offset, range->end - offset))
+				ERROR("can't decode %s at offset %lu of %s",
+				      range->sec->sym->name,
+				      offset - range->start, sec->name);
+
+			/* call, jmp and jcc with a rel8 or rel32 */
+			if (insn.vex ||
+			    !((insn.map == INSN_MAP_ONEBYTE &&
+			       ((insn.opcode >= 0x70 && insn.opcode <= 0x7f) ||
+				(insn.opcode >= 0xe0 && insn.opcode <= 0xe3) ||
+				insn.opcode == 0xe8 || insn.opcode == 0xe9 ||
+				insn.opcode == 0xeb)) ||
+			      (insn.map == INSN_MAP_0F &&
+			       insn.opcode >= 0x80 && insn.opcode <= 0x8f)))
+				continue;
+
+			disp = offset + insn.imm_offset;
+			if (covered[disp])
+				continue;
+			if (insn.imm_size == 4) {
+				memcpy(&rel32, buf + disp, 4);
+				dest = offset + insn.length + rel32;
+			} else if (insn.imm_size == 1) {
+				dest = offset + insn.length +
+				       (signed char)buf[disp];
+			} else
+				ERROR("%s: 16 bit branch at offset %lu of %s",
+				      range->sec->sym->name,
+				      offset - range->start, sec->name);
+			if (dest >= (long)range->start &&
+			    dest < (long)range->end)
+				continue;
+
+			target = dest < 0 ? NULL : find_split_range(info, dest);
+			if (!target || insn.imm_size != 4)
+				ERROR("%s: branch at offset %lu of %s can't be relocated",
+				      range->sec->sym->name,
+				      offset - range->start, sec->name);
+			branches[nr++] = disp;
+		}
+	}
+
+	if (!nr)
+		return;
+
+	if (!relasec) {
+		for_each_section(i, template, &kelf->sections)
+			if (is_rela_section(template))
+				break;
+		if (i == kelf->sections.nr)
+			ERROR("%s has branches between its functions but no relas to model them on",
+			      sec->name);
+		relasec = kpatch_new_section(kelf, template, "%s%s", ".rela",
+					     sec->name);
+		relasec->base = sec;
+		relasec->relas.nr = 0;
+		sec->rela = relasec;
+	}
+
+	relas = kpatch_alloc((relasec->relas.nr + nr) * sizeof(*relas));
+	memcpy(relas, relasec->relas.data, relasec->relas.nr * sizeof(*relas));
+	relasec->relas.data = relas;
+
+	for (i = 0; i < nr; i++) {
+		disp = branches[i];
+		range = find_split_range(info, disp);
+		memcpy(&rel32, buf + disp, 4);
+		dest = disp + 4 + rel32;
+		target = find_split_range(info, dest);
+
+		rela = &relas[relasec->relas.nr++];
+		memset(rela, 0, sizeof(*rela));
+		rela->sym = target->sec->sym;
+		rela->type = R_X86_64_PC32;
+		rela->addend = dest - target->start - 4;
+		rela->offset = disp;
+		rela->rela.r_info = GELF_R_INFO(0, R_X86_64_PC32);
+		rela->rela.r_addend = rela->addend;
+		rela->rela.r_offset = rela->offset;
+
+		log_debug("%s: branch at offset %lu to %s%+d\n", sec->name,
+			  disp, rela->sym->name, rela->addend);
+
+		/* like any other rela, the displacement is zero */
+		if (range->sec->data->d_buf == buf + range->start) {
+			range->sec->data->d_buf =
+				kpatch_alloc(range->end - range->start);
+			memcpy(range->sec->data->d_buf, buf + range->start,
+			       range->end - range->start);
+		}
+		memset(range->sec->data->d_buf + disp - range->start, 0, 4);
+	}
+}
+
+/* check whether a section name ends with "." and the first len chars of name */
+int is_symbol_section_name(char *secname, size_t seclen, char *name,
+			   size_t len)
+{
+	return seclen > len && secname[seclen - len - 1] == '.' &&
+	       !strncmp(secname + seclen - len, name, len);
+}
+
+/*
+ * Check whether a symbol is in a section of its own, as made by
+ * -ffunction-sections and -fdata-sections: a section named after the
+ * symbol, or for a cold part, after its parent function.
+ */
+int is_symbol_section(struct symbol *sym)
+{
+	char *secname = sym->sec->name, *cold;
+	size_t seclen = strlen(secname), len = strlen(sym->name);
+
+	cold = strstr(sym->name, ".cold");
+	if (cold && cold != sym->name &&
+	    is_symbol_section_name(secname, seclen, sym->name,
+				   cold - sym->name))
+		return 1;
+
+	return is_symbol_section_name(secname, seclen, sym->name, len);
+}
+
+/*
+ * The sections GCC puts functions and objects in without -ffunction-sections
+ * and -fdata-sections.  Only these are split up; sections named with
+ * __attribute__((section)), like .data..percpu or __verbose, are looked up
+ * by name by the module loader, so their names have to be kept.
+ */
+static char *default_sections[] = {
+	".text", ".text.unlikely", ".text.hot", ".text.startup",
+	".data", ".bss", ".rodata", NULL
+};
+
+int is_default_section(struct section *sec)
+{
+	char **name;
+
+	if (!strncmp(sec->name, ".rodata.", 8))
+		return 1;
+	for (name = default_sections; *name; name++)
+		if (!strcmp(sec->name, *name))
+			return 1;
+
+	return 0;
+}
+
+void kpatch_split_sections(struct kpatch_elf *kelf)
+{
+	struct section *sec, *vsec, *old;
+	struct symbol *sym, **syms;
+	struct split_info *info;
+	struct split_range *range;
+	struct rela *rela;
+	unsigned long start, end;
+	size_t old_nr;
+	int i, j, k, syms_nr = 0, ranges_nr;
+	char *buf, *own;
+
+	/*
+	 * Find the symbols in sections which need to be split: all of GCC's
+	 * default sections with functions or objects, except those which
+	 * already are the section of the symbol at their start.  Whether a
+	 * section is split can't depend on the offsets of its symbols, or a
+	 * section with one function wouldn't be split while its twin with
+	 * another function added would be.
+	 */
+	syms = kpatch_alloc(kelf->symbols.nr * sizeof(*syms));
+	info = kpatch_alloc(kelf->sections.nr * sizeof(*info));
+	memset(info, 0, kelf->sections.nr * sizeof(*info));
+	own = kpatch_alloc(kelf->sections.nr);
+	memset(own, 0, kelf->sections.nr);
+
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (sym->sec && !sym->sym.st_value &&
+		    (sym->type == STT_FUNC || sym->type == STT_OBJECT) &&
+		    is_symbol_section(sym))
+			own[sym->sec->index - 1] = 1;
+
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (sym->sec && is_default_section(sym->sec) &&
+		    (sym->sym.st_value || !own[sym->sec->index - 1]) &&
+		    (sym->type == STT_FUNC || sym->type == STT_OBJECT))
+			info[sym->sec->index - 1].nr = 1;
+
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (sym->sec && info[sym->sec->index - 1].nr &&
+		    (sym->type == STT_FUNC || sym->type == STT_OBJECT))
+			syms[syms_nr++] = sym;
+
+	if (!syms_nr)
+		return;
+
+	qsort(syms, syms_nr, sizeof(*syms), split_sym_cmp);
+
+	/*
+	 * Make room for a virtual section and a virtual rela section per
+	 * symbol and a rela section for the branches of each split section,
+	 * and move the section pointers over to the new table.
+	 */
+	old = kelf->sections.data;
+	old_nr = kelf->sections.nr;
+	kelf->sections.data = kpatch_alloc((old_nr + 3 * syms_nr) * sizeof(*sec));
+	memcpy(kelf->sections.data, old, old_nr * sizeof(*sec));
+
+#define remap_section(ptr) \
+	((ptr) = (struct section *)kelf->sections.data + ((ptr) - old))
+
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (sym->sec)
+			remap_section(sym->sec);
+	for_each_section(i, sec, &kelf->sections) {
+		if (is_rela_section(sec))
+			remap_section(sec->base);
+		else if (sec->rela)
+			remap_section(sec->rela);
+	}
+
+	/* create a virtual section for each symbol */
+	for (i = 0; i < syms_nr; i = j) {
+		sec = syms[i]->sec;
+		for (j = i; j < syms_nr && syms[j]->sec == sec; j++)
+			;
+
+		info[sec->index - 1].ranges =
+			kpatch_alloc((j - i) * sizeof(struct split_range));
+		ranges_nr = 0;
+		range = NULL;
+
+		for (k = i; k < j; k++) {
+			sym = syms[k];
+			start = sym->sym.st_value;
+
+			/* aliases and symbols nested in another symbol */
+			if (range && start < range->end) {
+				sym->sec = range->sec;
+				sym->sym.st_value -= range->start;
+				continue;
+			}
+
+			end = start + sym->sym.st_size;
+			if (!sym->sym.st_size)
+				end = k + 1 < j ? syms[k + 1]->sym.st_value :
+				      sec->sh.sh_size;
+			if (end > sec->sh.sh_size)
+				ERROR("symbol %s extends past the end of section %s",
+				      sym->name, sec->name);
+
+			vsec = kpatch_new_section(kelf, sec, "%s.%s",
+						  sec->name, sym->name);
+			vsec->sh.sh_size = end - start;
+			vsec->data->d_size = end - start;
+			if (sec->sh.sh_type != SHT_NOBITS)
+				vsec->data->d_buf = sec->data->d_buf + start;
+			vsec->sym = sym;
+			vsec->secsym = NULL;
+			vsec->rela = NULL;
+
+			log_debug("split %s from %s at offset %lu\n",
+				  vsec->name, sec->name, start);
+
+			sym->sec = vsec;
+			sym->sym.st_value = 0;
+
+			range = &info[sec->index - 1].ranges[ranges_nr++];
+			range->sec = vsec;
+			range->start = start;
+			range->end = end;
+			range->relas_nr = 0;
+		}
+		info[sec->index - 1].nr = ranges_nr;
+		sec->sym = NULL;
+
+		if (sec->sh.sh_flags & SHF_EXECINSTR)
+			kpatch_split_branches(kelf, sec, &info[sec->index - 1]);
+
+		/* zero out the split off parts of the original section */
+		if (sec->sh.sh_type != SHT_NOBITS) {
+			buf = kpatch_alloc(sec->data->d_size);
+			memcpy(buf, sec->data->d_buf, sec->data->d_size);
+			for (k = 0; k < ranges_nr; k++) {
+				range = &info[sec->index - 1].ranges[k];
+				memset(buf + range->start, 0,
+				       range->end - range->start);
+			}
+			sec->data->d_buf = buf;
+		}
+	}
+
+	for (i = 0; i < old_nr; i++) {
+		sec = &((struct section *)kelf->sections.data)[i];
+		if (info[i].nr && sec->rela)
+			kpatch_split_relas(kelf, sec, &info[i]);
+	}
+
+	/* refer to split off parts by their symbols */
+	for_each_section(i, sec, &kelf->sections) {
+		if (!is_rela_section(sec))
+			continue;
+		for_each_rela(j, rela, &sec->relas) {
+			sym = rela->sym;
+			if (sym->type != STT_SECTION || !sym->sec ||
+			    sym->sec->index > old_nr ||
+			    !info[sym->sec->index - 1].nr)
+				continue;
+			range = find_split_range(&info[sym->sec->index - 1],
+						 rela_target_offset(sec, rela));
+			if (!range)
+				continue;
+			rela->sym = range->sec->sym;
+			rela->addend -= range->start;
+			rela->rela.r_addend = rela->addend;
+		}
+	}
+}
+
+/*
+ * With -freorder-blocks-and-partition, GCC moves the cold blocks of a
+ * function "foo" into a separate function "foo.cold" (or "foo.cold.N" with
+ * older compilers) in a .text.unlikely section.  The cold part isn't a
+ * function in its own right; it jumps back into its parent, so the two are
+ * diffed and included as a unit.
+ */
+void kpatch_find_child_functions(struct kpatch_elf *kelf)
+{
+	struct symbol *sym, *parent;
+	char *cold, *p, *name;
+	int i;
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0 || sym->type != STT_FUNC)
+			continue;
+
+		cold = strstr(sym->name, ".cold");
+		if (!cold)
+			continue;
+		p = cold + 5;
+		if (*p == '.' && isdigit(p[1]))
+			while (isdigit(*++p))
+				;
+		if (*p)
+			continue;
+
+		name = kpatch_strndup(sym->name, cold - sym->name);
+		parent = find_symbol_by_name(&kelf->symbols, name);
+
+		if (!parent || parent->type != STT_FUNC)
+			continue;
+		if (parent->child)
+			ERROR("function %s has more than one cold part",
+			      parent->name);
+
+		log_debug("%s is the cold part of %s\n", sym->name,
+			  parent->name);
+		sym->parent = parent;
+		parent->child = sym;
+	}
+}
+
+struct kpatch_elf *kpatch_elf_open(void *buf, size_t size)
+{
+	Elf *elf;
+	int i;
+	struct kpatch_elf *kelf;
+	struct section *sec;
+
+	elf = elf_memory(buf, size);
+	if (!elf)
+		ERROR("elf_memory: %s", elf_errmsg(-1));
+	state->elfs[state->elfs_nr++] = elf;
+
+	kelf = kpatch_alloc(sizeof(*kelf));
+	memset(kelf, 0, sizeof(*kelf));
+
+	/* read and store section, symbol entries from file */
+	kelf->elf = elf;
+	kelf->native = gelf_getclass(elf) == ELFCLASS64;
+	kpatch_create_section_table(kelf);
+	kpatch_create_symbol_table(kelf);
+
+	/* for each rela section, read and store the rela entries */
+	for_each_section(i, sec, &kelf->sections) {
+		if (!is_rela_section(sec))
+			continue;
+		kpatch_create_rela_table(kelf, sec);
+	}
+
+	kpatch_split_sections(kelf);
+	kpatch_find_child_functions(kelf);
+
+	return kelf;
+}
+
+/*
+ * Functions which are passed __LINE__ by the WARN, BUG and might_sleep
+ * family of macros.  All of them take the file name first and the line
+ * number second, so on x86_64 the line number is loaded into %esi.
+ */
+static char *line_macro_funcs[] = {
+	"warn_slowpath_null",
+	"warn_slowpath_fmt",
+	"warn_slowpath_fmt_taint",
+	"__might_sleep",
+	"__might_fault",
+	"lockdep_rcu_suspicious",
+	NULL
+};
+
+int is_line_macro_func(struct symbol *sym)
+{
+	char **name;
+
+	for (name = line_macro_funcs; *name; name++)
+		if (!strcmp(sym->name, *name))
+			return 1;
+
+	return 0;
+}
+
+#define REG_RSI 6
+
+/* check whether an instruction is "mov $imm32, %esi", with no prefixes */
+int is_line_mov(struct insn *insn)
+{
+	return insn->map == INSN_MAP_ONEBYTE && !insn->vex &&
+	       !insn->prefixes && !insn->rex &&
+	       insn->opcode == 0xb8 + REG_RSI;
+}
+
+/*
+ * Check whether an instruction is one which doesn't use %rsi and doesn't
+ * change the flow of control: the common data moves and arithmetic with
+ * no %rsi operand.  Anything else, including any call, is taken to use
+ * %esi.
+ */
+int insn_keeps_rsi(struct insn *insn)
+{
+	unsigned char op = insn->opcode, reg, rm, base, index;
+	int group;
+
+	if (insn->vex)
+		return 0;
+
+	if (insn->map == INSN_MAP_ONEBYTE) {
+		/* registers encoded in the opcode */
+		if ((op >= 0x50 && op <= 0x5f) || (op >= 0x90 && op <= 0x97) ||
+		    (op >= 0xb0 && op <= 0xbf))
+			return ((op & 7) | (insn->rex & INSN_REX_B ? 8 : 0)) !=
+			       REG_RSI;
+		if (op == 0x98 || op == 0x99)
+			return 1;
+		if (!insn->has_modrm)
+			/* ALU ops on the accumulator */
+			return op < 0x40 && (op & 7) >= 4 && (op & 7) <= 5;
+		if (op >= 0x40 && !(op == 0x63 || op == 0x69 || op == 0x6b ||
+				    (op >= 0x80 && op <= 0x8b && op != 0x82) ||
+				    op == 0x8d || op == 0xc0 || op == 0xc1 ||
+				    op == 0xc6 || op == 0xc7 ||
+				    (op >= 0xd0 && op <= 0xd3) ||
+				    op == 0xf6 || op == 0xf7))
+			return 0;
+		group = (op >= 0x80 && op <= 0x83) || op == 0xc0 ||
+			op == 0xc1 || op == 0xc6 || op == 0xc7 ||
+			(op >= 0xd0 && op <= 0xd3) || op == 0xf6 || op == 0xf7;
+	} else if (insn->map == INSN_MAP_0F) {
+		if (!((op >= 0x40 && op <= 0x4f) ||
+		      (op >= 0x90 && op <= 0x9f) || op == 0x1f ||
+		      op == 0xaf || op == 0xb6 || op == 0xb7 || op == 0xbe ||
+		      op == 0xbf))
+			return 0;
+		group = op == 0x1f || (op >= 0x90 && op <= 0x9f);
+	} else
+		return 0;
+
+	/* the ModRM operands, where reg is an opcode extension for groups */
+	reg = ((insn->modrm >> 3) & 7) | (insn->rex & INSN_REX_R ? 8 : 0);
+	if (!group && reg == REG_RSI)
+		return 0;
+	rm = (insn->modrm & 7) | (insn->rex & INSN_REX_B ? 8 : 0);
+	if (insn->modrm >> 6 == 3)
+		return rm != REG_RSI;
+	if (insn->has_sib) {
+		base = (insn->sib & 7) | (insn->rex & INSN_REX_B ? 8 : 0);
+		index = ((insn->sib >> 3) & 7) |
+			(insn->rex & INSN_REX_X ? 8 : 0);
+		if (!(insn->modrm >> 6 == 0 && (insn->sib & 7) == 5) &&
+		    base == REG_RSI)
+			return 0;
+		return index != REG_RSI;
+	}
+	return (insn->modrm >> 6 == 0 && (insn->modrm & 7) == 5) ||
+	       rm != REG_RSI;
+}
+
+/*
+ * Find the "mov $imm32, %esi" instructions in a text section which load
+ * the line number argument of one of the line_macro_funcs: the immediate
+ * isn't relocated and the next instruction which uses %esi is a call to
+ * the function.  The instructions are decoded from the start of the
+ * section, which has to be a function.  Their offsets are marked in lines.
+ * Returns -1 if the section can't be decoded.
+ */
+int kpatch_find_line_movs(struct section *sec, unsigned char *buf,
+			  char *lines)
+{
+	struct insn insn;
+	struct rela *rela;
+	unsigned long offset, size = sec->sh.sh_size;
+	long mov = -1;
+	char *relocated, *linecall;
+	int i;
+
+	relocated = kpatch_alloc(size);
+	memset(relocated, 0, size);
+	linecall = kpatch_alloc(size);
+	memset(linecall, 0, size);
+	for_each_rela(i, rela, &sec->rela->relas) {
+		if ((unsigned long)rela->offset >= size)
+			continue;
+		relocated[rela->offset] = 1;
+		if (is_line_macro_func(rela->sym))
+			linecall[rela->offset] = 1;
+	}
+
+	memset(lines, 0, size);
+	for (offset = 0; offset < size; offset += insn.length) {
+		if (insn_decode(&insn, buf + offset, size - offset))
+			return -1;
+
+		if (is_line_mov(&insn) && !relocated[offset + insn.imm_offset]) {
+			mov = offset;
+			continue;
+		}
+		if (mov < 0)
+			continue;
+
+		if (insn.map == INSN_MAP_ONEBYTE && !insn.vex &&
+		    insn.opcode == 0xe8 && insn.imm_size == 4 &&
+		    linecall[offset + insn.imm_offset])
+			lines[mov] = 1;
+		if (!insn_keeps_rsi(&insn))
+			mov = -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Check whether the only differences between a text section and its twin
+ * are "mov $imm32, %esi" instructions loading the line number argument for
+ * one of the line_macro_funcs.  Adding or removing lines
+ * earlier in the file shifts __LINE__ for every later WARN_ON() or
+ * might_sleep() and such functions don't need to be replaced.
+ */
+int kpatch_line_macro_change_only(struct section *sec)
+{
+	unsigned char *buf1, *buf2;
+	struct rela *rela;
+	unsigned long offset, insn;
+	char *lines1, *lines2;
+	int i, lineonly = 0;
+
+	if (!(sec->sh.sh_flags & SHF_EXECINSTR) ||
+	    sec->sh.sh_type == SHT_NOBITS ||
+	    sec->sh.sh_size != sec->twin->sh.sh_size ||
+	    !sec->rela || !sec->twin->rela ||
+	    sec->rela->relas.nr != sec->twin->rela->relas.nr)
+		return 0;
+
+	/* the relas must be identical */
+	for_each_rela(i, rela, &sec->rela->relas)
+		if (!rela->twin)
+			return 0;
+
+	buf1 = sec->twin->data->d_buf;
+	buf2 = sec->data->d_buf;
+	lines1 = kpatch_alloc(sec->sh.sh_size);
+	lines2 = kpatch_alloc(sec->sh.sh_size);
+	if (kpatch_find_line_movs(sec->twin, buf1, lines1) ||
+	    kpatch_find_line_movs(sec, buf2, lines2))
+		return 0;
+
+	/* every difference has to be in the immediate of such a mov */
+	for (offset = 0; offset < sec->sh.sh_size; offset++) {
+		if (buf1[offset] == buf2[offset])
+			continue;
+
+		for (insn = offset > 4 ? offset - 4 : 0; insn < offset; insn++)
+			if (lines1[insn] && lines2[insn])
+				break;
+		if (insn == offset)
+			return 0;
+
+		lineonly = 1;
+	}
+
+	return lineonly;
+}
+
+/*
+ * struct bug_entry, as emitted by the x86_64 BUG() and WARN() macros
+ * with CONFIG_DEBUG_BUGVERBOSE, is two relative pointers followed by
+ * a 16 bit line number and 16 bit flags.
+ */
+#define BUG_ENTRY_SIZE		12
+#define BUG_ENTRY_LINE_OFFSET	8
+#define BUG_ENTRY_LINE_SIZE	2
+
+/*
+ * Check whether the only differences in the __bug_table section are line
+ * numbers.
+ */
+int kpatch_bug_table_line_change_only(struct section *sec)
+{
+	unsigned char *buf1, *buf2;
+	unsigned long offset;
+	struct rela *rela;
+	int i;
+
+	if (strcmp(sec->name, "__bug_table") ||
+	    sec->sh.sh_size != sec->twin->sh.sh_size ||
+	    sec->sh.sh_size % BUG_ENTRY_SIZE ||
+	    !sec->rela || !sec->twin->rela ||
+	    sec->rela->relas.nr != sec->twin->rela->relas.nr)
+		return 0;
+
+	for_each_rela(i, rela, &sec->rela->relas)
+		if (!rela->twin)
+			return 0;
+
+	buf1 = sec->twin->data->d_buf;
+	buf2 = sec->data->d_buf;
+
+	for (offset = 0; offset < sec->sh.sh_size; offset += BUG_ENTRY_SIZE)
+		if (memcmp(buf1 + offset, buf2 + offset,
+			   BUG_ENTRY_LINE_OFFSET) ||
+		    memcmp(buf1 + offset + BUG_ENTRY_LINE_OFFSET +
+			   BUG_ENTRY_LINE_SIZE,
+			   buf2 + offset + BUG_ENTRY_LINE_OFFSET +
+			   BUG_ENTRY_LINE_SIZE,
+			   BUG_ENTRY_SIZE - BUG_ENTRY_LINE_OFFSET -
+			   BUG_ENTRY_LINE_SIZE))
+			return 0;
+
+	return 1;
+}
+
+int strcmp_ptr(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Merged string sections are compared by content rather than by offset.
+ * Adding a string literal shifts the offsets of all later strings in the
+ * section, but as long as every string in the patched section also exists
+ * in the base section, nothing has really changed.  Relas referring to the
+ * strings are compared by string content in rela_equal().
+ */
+enum status kpatch_compare_string_section(struct section *sec)
+{
+	struct section *sec1 = sec, *sec2 = sec->twin;
+	char **strings, *buf, *str;
+	size_t nr = 0, size, offset;
+	enum status status = SAME;
+
+	if (sec1->sh.sh_entsize != 1)
+		return CHANGED;
+
+	/* sort the base strings so they can be searched */
+	buf = sec2->data->d_buf;
+	size = sec2->data->d_size;
+	if (size && buf[size - 1])
+		return CHANGED;
+	strings = kpatch_alloc(size * sizeof(*strings));
+	for (offset = 0; offset < size; offset += strlen(buf + offset) + 1)
+		strings[nr++] = buf + offset;
+	qsort(strings, nr, sizeof(*strings), strcmp_ptr);
+
+	buf = sec1->data->d_buf;
+	size = sec1->data->d_size;
+	if (size && buf[size - 1])
+		status = CHANGED;
+	for (offset = 0; offset < size && status == SAME;
+	     offset += strlen(buf + offset) + 1) {
+		str = buf + offset;
+		if (!bsearch(&str, strings, nr, sizeof(*strings), strcmp_ptr))
+			status = CHANGED;
+	}
+
+	return status;
+}
+
+void kpatch_compare_correlated_nonrela_section(struct section *sec)
+{
+	struct section *sec1 = sec, *sec2 = sec->twin;
+
+	/* Compare section headers (must match or fatal) */
+	if (sec1->sh.sh_type != sec2->sh.sh_type ||
+	    sec1->sh.sh_flags != sec2->sh.sh_flags ||
+	    sec1->sh.sh_addr != sec2->sh.sh_addr ||
+	    sec1->sh.sh_addralign != sec2->sh.sh_addralign ||
+	    sec1->sh.sh_entsize != sec2->sh.sh_entsize ||
+	    sec1->sh.sh_link != sec1->sh.sh_link)
+		DIFF_FATAL("%s section header details differ", sec1->name);
+
+	if (sec1->sh.sh_flags & SHF_STRINGS)
+		sec1->status = kpatch_compare_string_section(sec1);
+	else if (sec1->sh.sh_size != sec2->sh.sh_size ||
+	    sec1->data->d_size != sec2->data->d_size || 
+	    (sec1->sh.sh_type != SHT_NOBITS &&
+	     memcmp(sec1->data->d_buf, sec2->data->d_buf, sec1->data->d_size)))
+		sec1->status = CHANGED;
+	else
+		sec1->status = SAME;
+
+	if (sec1->status == CHANGED &&
+	    (kpatch_line_macro_change_only(sec1) ||
+	     kpatch_bug_table_line_change_only(sec1))) {
+		log_normal("%s: ignoring __LINE__ change\n", sec1->name);
+		sec1->status = SAME;
+	}
+}
+
+void kpatch_compare_correlated_nonrela_sections(struct table *table)
+{
+	struct section *sec;
+	int i;
+
+	for_each_section(i, sec, table) {
+		if (is_rela_section(sec))
+			continue;
+		if (sec->twin)
+			kpatch_compare_correlated_nonrela_section(sec);
+		else
+			sec->status = NEW;
+
+		/* sync any rela section and associated symbols */
+		if (sec->sym)
+			sec->sym->status = sec->status;
+		if (sec->secsym)
+			sec->secsym->status = sec->status;
+		if (sec->rela)
+			sec->rela->status = sec->status;
+	}
+}
+
+void kpatch_compare_correlated_symbol(struct symbol *sym)
+{
+	struct symbol *sym1 = sym, *sym2 = sym->twin;
+
+	if (sym1->sym.st_info != sym2->sym.st_info ||
+	    sym1->sym.st_other != sym2->sym.st_other ||
+	    (sym1->sec && sym2->sec && sym1->sec->twin != sym2->sec) ||
+	    (sym1->sec && !sym2->sec) ||
+	    (sym2->sec && !sym1->sec))
+		DIFF_FATAL("symbol info mismatch: %s", sym1->name);
+
+	if (sym1->type == STT_OBJECT &&
+	    sym1->sym.st_size != sym2->sym.st_size)
+		DIFF_FATAL("object size mismatch: %s", sym1->name);
+
+	if (sym1->sym.st_shndx == SHN_UNDEF ||
+	     sym1->sym.st_shndx == SHN_ABS)
+		sym1->status = SAME;
+}
+
+void kpatch_compare_correlated_symbols(struct table *table)
+{
+	struct symbol *sym;
+	int i;
+
+	for_each_symbol(i, sym, table) {
+		if (i == 0) /* ugh */
+			continue;
+		if (sym->twin)
+			kpatch_compare_correlated_symbol(sym);
+		else
+			sym->status = NEW;
+
+		log_debug("symbol %s is %s\n", sym->name, status_str(sym->status));
+	}
+}
+
+/*
+ * GCC appends numeric suffixes to the names of function-local statics and
+ * of some function clones, e.g. "foo.1234" or "bar.isra.0".  The numbers
+ * can change whenever an unrelated part of the file changes, so these
+ * symbols and their sections aren't correlated by name.  They're handled
+ * by kpatch_correlate_mangled_symbols() instead.
+ */
+int is_mangled_name(const char *name)
+{
+	const char *p;
+
+	for (p = strchr(name, '.'); p; p = strchr(p + 1, '.'))
+		if (isdigit(p[1]))
+			return 1;
+
+	return 0;
+}
+
+int is_mangled_sym(struct symbol *sym)
+{
+	return sym->bind == STB_LOCAL &&
+	       (sym->type == STT_FUNC || sym->type == STT_OBJECT) &&
+	       sym->sec && sym->sec->sym == sym && is_mangled_name(sym->name);
+}
+
+int is_mangled_section(struct section *sec)
+{
+	if (is_rela_section(sec))
+		sec = sec->base;
+
+	return sec->sym && is_mangled_sym(sec->sym);
+}
+
+/* compare two names, ignoring the digits of any numeric suffixes */
+int mangled_strcmp(const char *str1, const char *str2)
+{
+	while (*str1 == *str2) {
+		if (!*str1)
+			return 0;
+		if (*str1 == '.' && isdigit(str1[1])) {
+			if (!isdigit(str2[1]))
+				return 1;
+			while (isdigit(*++str1))
+				;
+			while (isdigit(*++str2))
+				;
+		} else {
+			str1++;
+			str2++;
+		}
+	}
+
+	return 1;
+}
+
+void kpatch_correlate_sections(struct table *table1, struct table *table2)
+{
+	struct section *sec1, *sec2;
+	int i, j;
+
+	/* correlate all sections and compare nonrela sections */
+	for_each_section(i, sec1, table1) {
+		if (is_mangled_section(sec1))
+			continue;
+		for_each_section(j, sec2, table2) {
+			if (is_mangled_section(sec2))
+				continue;
+			if (strcmp(sec1->name, sec2->name))
+				continue;
+			sec1->twin = sec2;
+			sec2->twin = sec1;
+			/* set initial status, might change */
+			sec1->status = sec2->status = SAME;
+			break;
+		}
+	}
+}
+
+void kpatch_correlate_symbols(struct table *table1, struct table *table2)
+{
+	struct symbol *sym1, *sym2;
+	int i, j;
+
+	for_each_symbol(i, sym1, table1) {
+		if (i == 0) /* ugh */
+			continue;
+		if (is_mangled_sym(sym1) ||
+		    (sym1->type == STT_SECTION && is_mangled_section(sym1->sec)))
+			continue;
+		for_each_symbol(j, sym2, table2) {
+			if (j == 0) /* double ugh */
+				continue;
+			if (is_mangled_sym(sym2) ||
+			    (sym2->type == STT_SECTION &&
+			     is_mangled_section(sym2->sec)))
+				continue;
+			if (!strcmp(sym1->name, sym2->name)) {
+				sym1->twin = sym2;
+				sym2->twin = sym1;
+				/* set initial status, might change */
+				sym1->status = sym2->status = SAME;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Find the first function which refers to each mangled symbol.  A static
+ * local is referred to by the function it's declared in, which tells
+ * statics of the same name in different functions apart.
+ */
+struct symbol **kpatch_find_mangled_referrers(struct kpatch_elf *kelf)
+{
+	struct symbol **referrers, *sym, *func;
+	struct section *sec;
+	struct rela *rela;
+	int i, j;
+
+	referrers = kpatch_alloc(kelf->symbols.nr * sizeof(*referrers));
+	memset(referrers, 0, kelf->symbols.nr * sizeof(*referrers));
+
+	for_each_section(i, sec, &kelf->sections) {
+		if (!is_rela_section(sec))
+			continue;
+		func = sec->base->sym;
+		if (!func || func->type != STT_FUNC)
+			continue;
+		for_each_rela(j, rela, &sec->relas) {
+			sym = rela->sym;
+			if (sym->type == STT_SECTION && sym->sec &&
+			    sym->sec->sym)
+				sym = sym->sec->sym;
+			if (is_mangled_sym(sym) && sym != func &&
+			    !referrers[sym->index])
+				referrers[sym->index] = func;
+		}
+	}
+
+	return referrers;
+}
+
+/*
+ * Check that the sections of two mangled symbols have the same contents
+ * and relocations.
+ */
+int kpatch_mangled_sections_equal(struct section *sec1, struct section *sec2)
+{
+	struct rela *rela1, *rela2;
+	int i;
+
+	if (sec1->sh.sh_type != sec2->sh.sh_type ||
+	    sec1->sh.sh_size != sec2->sh.sh_size ||
+	    sec1->data->d_size != sec2->data->d_size ||
+	    (sec1->sh.sh_type != SHT_NOBITS &&
+	     memcmp(sec1->data->d_buf, sec2->data->d_buf, sec1->data->d_size)))
+		return 0;
+
+	if (!sec1->rela || !sec2->rela)
+		return !sec1->rela && !sec2->rela;
+
+	if (sec1->rela->relas.nr != sec2->rela->relas.nr)
+		return 0;
+
+	for (i = 0; i < sec1->rela->relas.nr; i++) {
+		rela1 = &((struct rela *)sec1->rela->relas.data)[i];
+		rela2 = &((struct rela *)sec2->rela->relas.data)[i];
+		if (rela1->type != rela2->type ||
+		    rela1->offset != rela2->offset)
+			return 0;
+		if (rela1->string || rela2->string) {
+			if (!rela1->string || !rela2->string ||
+			    strcmp(rela1->string, rela2->string))
+				return 0;
+		} else if (rela1->addend != rela2->addend ||
+			   mangled_strcmp(rela1->sym->name, rela2->sym->name))
+			return 0;
+	}
+
+	return 1;
+}
+
+int kpatch_mangled_syms_match(struct symbol *sym1, struct symbol **referrers1,
+			      struct symbol *sym2, struct symbol **referrers2)
+{
+	struct symbol *func1, *func2;
+
+	if (sym1->twin || sym2->twin ||
+	    !is_mangled_sym(sym1) || !is_mangled_sym(sym2) ||
+	    sym1->sym.st_info != sym2->sym.st_info ||
+	    mangled_strcmp(sym1->name, sym2->name))
+		return 0;
+
+	/* function clones may be called from anywhere */
+	if (sym1->type == STT_FUNC)
+		return 1;
+
+	func1 = referrers1[sym1->index];
+	func2 = referrers2[sym2->index];
+	if (!func1 || !func2)
+		return !func1 && !func2;
+
+	return !mangled_strcmp(func1->name, func2->name);
+}
+
+void kpatch_correlate_mangled_symbol(struct symbol *sym1, struct symbol *sym2)
+{
+	struct section *sec1 = sym1->sec, *sec2 = sym2->sec;
+
+	log_debug("correlating %s with %s\n", sym1->name, sym2->name);
+
+	sym1->twin = sym2;
+	sym2->twin = sym1;
+	sec1->twin = sec2;
+	sec2->twin = sec1;
+	sym1->status = sym2->status = SAME;
+	sec1->status = sec2->status = SAME;
+
+	/*
+	 * The patched object must refer to the symbol by the name it has in
+	 * the running kernel.
+	 */
+	sym2->name = sym1->name;
+	sec2->name = sec1->name;
+
+	if (sec1->secsym && sec2->secsym) {
+		sec1->secsym->twin = sec2->secsym;
+		sec2->secsym->twin = sec1->secsym;
+		sec1->secsym->status = sec2->secsym->status = SAME;
+		sec2->secsym->name = sec2->name;
+	}
+
+	if (sec1->rela && sec2->rela) {
+		sec1->rela->twin = sec2->rela;
+		sec2->rela->twin = sec1->rela;
+		sec1->rela->status = sec2->rela->status = SAME;
+		sec2->rela->name = sec1->rela->name;
+	}
+}
+
+/*
+ * Correlate the mangled symbols skipped by kpatch_correlate_symbols().
+ * Symbols are matched by name, ignoring the numeric suffixes, and by the
+ * function referring to them.  Where there are several candidates, the one
+ * whose section has identical contents and relocations is used, preferring
+ * an exact name match.  Failing that, a symbol is correlated with a changed
+ * counterpart only if the match is unique in both objects.
+ */
+void kpatch_correlate_mangled_symbols(struct kpatch_elf *kelf1,
+				      struct kpatch_elf *kelf2)
+{
+	struct symbol *sym1, *sym2, *sym, *match, **referrers1, **referrers2;
+	int i, j, k, nr, pass;
+
+	referrers1 = kpatch_find_mangled_referrers(kelf1);
+	referrers2 = kpatch_find_mangled_referrers(kelf2);
+
+	/* pass 0: identical and same name, 1: identical, 2: unique */
+	for (pass = 0; pass < 3; pass++) {
+		for_each_symbol(i, sym1, &kelf1->symbols) {
+			if (i == 0 || sym1->twin)
+				continue;
+
+			match = NULL;
+			nr = 0;
+			for_each_symbol(j, sym2, &kelf2->symbols) {
+				if (j == 0 ||
+				    !kpatch_mangled_syms_match(sym1, referrers1,
+							       sym2, referrers2))
+					continue;
+				nr++;
+				if (pass == 2) {
+					match = sym2;
+					continue;
+				}
+				if ((pass == 0 && strcmp(sym1->name, sym2->name)) ||
+				    !kpatch_mangled_sections_equal(sym1->sec,
+								   sym2->sec))
+					continue;
+				match = sym2;
+				break;
+			}
+
+			if (pass == 2 && match) {
+				if (nr != 1)
+					continue;
+				nr = 0;
+				for_each_symbol(k, sym, &kelf1->symbols)
+					if (k && kpatch_mangled_syms_match(sym,
+							referrers1, match,
+							referrers2))
+						nr++;
+				if (nr != 1)
+					continue;
+			}
+
+			if (match)
+				kpatch_correlate_mangled_symbol(sym1, match);
+		}
+	}
+
+}
+
+int rela_equal(struct rela *rela1, struct rela *rela2)
+{
+	if (rela1->type != rela2->type ||
+	    rela1->offset != rela2->offset)
+		return 0;
+
+	if (rela1->string) {
+		if (rela2->string &&
+		    !strcmp(rela1->string, rela2->string))
+			return 1;
+	} else {
+		if (strcmp(rela1->sym->name, rela2->sym->name))
+			return 0;
+		if (rela1->addend == rela2->addend)
+			return 1;
+	}
+
+	return 0;
+}
+
+void kpatch_correlate_relas(struct section *sec)
+{
+	struct rela *rela1, *rela2;
+	int i, j;
+
+	for_each_rela(i, rela1, &sec->relas) {
+		for_each_rela(j, rela2, &sec->twin->relas) {
+			    if (rela_equal(rela1, rela2)) {
+				rela1->twin = rela2;
+				rela2->twin = rela1;
+				rela1->status = rela2->status = SAME;
+				break;
+			}
+		}
+	}
+}
+
+void kpatch_compare_ehdrs(GElf_Ehdr *eh1, GElf_Ehdr *eh2)
+{
+	if (memcmp(eh1->e_ident, eh2->e_ident, EI_NIDENT) ||
+	    eh1->e_type != eh2->e_type ||
+	    eh1->e_machine != eh2->e_machine ||
+	    eh1->e_version != eh2->e_version ||
+	    eh1->e_entry != eh2->e_entry ||
+	    eh1->e_phoff != eh2->e_phoff ||
+	    eh1->e_flags != eh2->e_flags ||
+	    eh1->e_ehsize != eh2->e_ehsize ||
+	    eh1->e_phentsize != eh2->e_phentsize ||
+	    eh1->e_shentsize != eh2->e_shentsize)
+		DIFF_FATAL("ELF headers differ");
+}
+
+void kpatch_compare_elf_headers(Elf *elf1, Elf *elf2)
+{
+	GElf_Ehdr eh1, eh2;
+
+	if (!gelf_getehdr(elf1, &eh1))
+		ERROR("gelf_getehdr");
+
+	if (!gelf_getehdr(elf2, &eh2))
+		ERROR("gelf_getehdr");
+
+	kpatch_compare_ehdrs(&eh1, &eh2);
+}
+
+void kpatch_check_program_headers(Elf *elf)
+{
+	size_t ph_nr;
+
+	if (elf_getphdrnum(elf, &ph_nr))
+		ERROR("elf_getphdrnum");
+
+	if (ph_nr != 0)
+		DIFF_FATAL("ELF contains program header");
+}
+
+void kpatch_set_rela_section_status(struct section *sec)
+{
+	struct rela *rela;
+	int i;
+
+	for_each_rela(i, rela, &sec->relas)
+		if (rela->status == NEW) {
+			/*
+			 * This rela section is different. Make
+			 * sure the text section and any associated
+			 * symbols come along too.
+			 */
+			sec->status = CHANGED;
+			sec->base->status = CHANGED;
+			if (sec->base->sym)
+				sec->base->sym->status = CHANGED;
+			if (sec->base->secsym)
+				sec->base->secsym->status = CHANGED;
+			return;
+		}
+
+	/*
+	 * The difference in the section data was due to the renumeration
+	 * of symbol indexes.  Consider this rela section unchanged.
+	 */
+	sec->status = SAME;
+}
+
+void kpatch_correlate_elfs(struct kpatch_elf *kelf1, struct kpatch_elf *kelf2)
+{
+	struct section *sec;
+	int i;
+
+	kpatch_correlate_sections(&kelf1->sections, &kelf2->sections);
+	kpatch_correlate_symbols(&kelf1->symbols, &kelf2->symbols);
+	kpatch_correlate_mangled_symbols(kelf1, kelf2);
+
+	/* at this point, sections are correlated, we can use sec->twin */
+	for_each_section(i, sec, &kelf1->sections)
+		if (is_rela_section(sec))
+			kpatch_correlate_relas(sec);
+}
+
+void kpatch_mark_function_changed(struct symbol *sym)
+{
+	if (sym->status != SAME)
+		return;
+
+	sym->status = CHANGED;
+	sym->sec->status = CHANGED;
+	if (sym->sec->secsym)
+		sym->sec->secsym->status = CHANGED;
+	if (sym->sec->rela)
+		sym->sec->rela->status = CHANGED;
+}
+
+/*
+ * A cold part jumps back into the function it was split from, so if
+ * either of them has changed, both have to be replaced.
+ */
+void kpatch_sync_child_functions(struct kpatch_elf *kelf)
+{
+	struct symbol *sym;
+	int i;
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (!sym->parent || !sym->sec || !sym->parent->sec)
+			continue;
+		if (sym->status == SAME && sym->parent->status == SAME)
+			continue;
+
+		kpatch_mark_function_changed(sym);
+		kpatch_mark_function_changed(sym->parent);
+	}
+}
+
+void kpatch_compare_correlated_elements(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	int i;
+
+	/* tables are already correlated at this point */
+	kpatch_compare_correlated_nonrela_sections(&kelf->sections);
+	kpatch_compare_correlated_symbols(&kelf->symbols);
+
+	for_each_section(i, sec, &kelf->sections)
+		if (is_rela_section(sec) && sec->status == SAME)
+			kpatch_set_rela_section_status(sec);
+
+	kpatch_sync_child_functions(kelf);
+}
+
+/*
+ * Fingerprints
+ *
+ * Rather than keeping the original objects around, a build can record a
+ * fingerprint of each section of the base objects: a hash of its header,
+ * its contents and its relocations, with the relocations described by the
+ * names of their targets rather than by symbol indexes.  A patched object
+ * is then compared against the fingerprints instead of against a rebuilt
+ * original object.
+ */
+#define FNV_OFFSET_BASIS	0xcbf29ce484222325ULL
+#define FNV_PRIME		0x100000001b3ULL
+
+unsigned long long fnv1a(unsigned long long hash, const void *buf,
+			 size_t size)
+{
+	const unsigned char *p = buf;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+/*
+ * Clear the line numbers which kpatch_line_macro_change_only() and
+ * kpatch_bug_table_line_change_only() ignore, so a section's fingerprint
+ * doesn't change when only __LINE__ does.
+ */
+void kpatch_mask_line_numbers(struct section *sec, unsigned char *buf)
+{
+	unsigned long offset;
+	char *lines;
+
+	if (!strcmp(sec->name, "__bug_table")) {
+		if (sec->sh.sh_size % BUG_ENTRY_SIZE)
+			return;
+		for (offset = 0; offset < sec->sh.sh_size;
+		     offset += BUG_ENTRY_SIZE)
+			memset(buf + offset + BUG_ENTRY_LINE_OFFSET, 0,
+			       BUG_ENTRY_LINE_SIZE);
+		return;
+	}
+
+	if (!(sec->sh.sh_flags & SHF_EXECINSTR) || !sec->rela ||
+	    sec->sh.sh_type == SHT_NOBITS)
+		return;
+
+	/* same rules as kpatch_line_macro_change_only() */
+	lines = kpatch_alloc(sec->sh.sh_size);
+	if (kpatch_find_line_movs(sec, buf, lines))
+		return;
+	for (offset = 0; offset < sec->sh.sh_size; offset++)
+		if (lines[offset])
+			memset(buf + offset + 1, 0, 4);
+}
+
+/* merged strings are compared by content, see kpatch_compare_string_section() */
+unsigned long long kpatch_string_section_fingerprint(struct section *sec,
+						     unsigned long long hash)
+{
+	char **strings, *buf = sec->data->d_buf;
+	size_t nr = 0, size = sec->data->d_size, offset, i;
+
+	if (sec->sh.sh_entsize != 1 || (size && buf[size - 1]))
+		return fnv1a(hash, buf, size);
+
+	strings = kpatch_alloc(size * sizeof(*strings));
+	for (offset = 0; offset < size; offset += strlen(buf + offset) + 1)
+		strings[nr++] = buf + offset;
+	qsort(strings, nr, sizeof(*strings), strcmp_ptr);
+
+	for (i = 0; i < nr; i++)
+		if (!i || strcmp(strings[i - 1], strings[i]))
+			hash = fnv1a(hash, strings[i], strlen(strings[i]) + 1);
+
+	return hash;
+}
+
+unsigned long long kpatch_section_fingerprint(struct section *sec)
+{
+	unsigned long long hash = FNV_OFFSET_BASIS;
+	unsigned char *buf;
+	struct rela *rela;
+	int i;
+
+	hash = fnv1a(hash, &sec->sh.sh_type, sizeof(sec->sh.sh_type));
+	hash = fnv1a(hash, &sec->sh.sh_flags, sizeof(sec->sh.sh_flags));
+	hash = fnv1a(hash, &sec->sh.sh_addralign,
+		     sizeof(sec->sh.sh_addralign));
+	hash = fnv1a(hash, &sec->sh.sh_entsize, sizeof(sec->sh.sh_entsize));
+
+	if (sec->sh.sh_flags & SHF_STRINGS)
+		return kpatch_string_section_fingerprint(sec, hash);
+
+	hash = fnv1a(hash, &sec->sh.sh_size, sizeof(sec->sh.sh_size));
+	if (sec->sh.sh_type != SHT_NOBITS && sec->data->d_size) {
+		buf = kpatch_alloc(sec->data->d_size);
+		memcpy(buf, sec->data->d_buf, sec->data->d_size);
+		kpatch_mask_line_numbers(sec, buf);
+		hash = fnv1a(hash, buf, sec->data->d_size);
+	}
+
+	if (!sec->rela)
+		return hash;
+
+	/* compare the relas the way rela_equal() does */
+	for_each_rela(i, rela, &sec->rela->relas) {
+		hash = fnv1a(hash, &rela->type, sizeof(rela->type));
+		hash = fnv1a(hash, &rela->offset, sizeof(rela->offset));
+		if (rela->string) {
+			hash = fnv1a(hash, "s", 1);
+			hash = fnv1a(hash, rela->string,
+				     strlen(rela->string) + 1);
+		} else {
+			hash = fnv1a(hash, rela->sym->name,
+				     strlen(rela->sym->name) + 1);
+			hash = fnv1a(hash, &rela->addend, sizeof(rela->addend));
+		}
+	}
+
+	return hash;
+}
+
+/*
+ * The fingerprint database is text, one line per ELF header, section and
+ * symbol:
+ *
+ *   elf <e_ident> <type> <machine> <version> <entry> <phoff> <flags> <ehsize> <phentsize> <shentsize>
+ *   section <name> <fingerprint>
+ *   symbol <name> <st_info> <st_other> <st_size> <section|->
+ *   mangled <name> <st_info> <st_other> <st_size> <section> <referrer|->
+ *
+ * Mangled symbols are listed with the function referring to them, so they
+ * can be correlated like in kpatch_correlate_mangled_symbols().
+ */
+void kpatch_write_fingerprints(struct kpatch_elf *kelf, FILE *out)
+{
+	struct symbol **referrers, *sym;
+	struct section *sec;
+	GElf_Ehdr eh;
+	int i;
+
+	if (!gelf_getehdr(kelf->elf, &eh))
+		ERROR("gelf_getehdr");
+
+	fprintf(out, "elf ");
+	for (i = 0; i < EI_NIDENT; i++)
+		fprintf(out, "%02x", eh.e_ident[i]);
+	fprintf(out, " %u %u %u %lu %lu %u %u %u %u\n",
+		eh.e_type, eh.e_machine, eh.e_version,
+		(unsigned long)eh.e_entry, (unsigned long)eh.e_phoff,
+		eh.e_flags, eh.e_ehsize, eh.e_phentsize, eh.e_shentsize);
+
+	for_each_section(i, sec, &kelf->sections) {
+		if (is_rela_section(sec) || !strncmp(sec->name, ".debug", 6))
+			continue;
+		fprintf(out, "section %s %016llx\n", sec->name,
+			kpatch_section_fingerprint(sec));
+	}
+
+	referrers = kpatch_find_mangled_referrers(kelf);
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0 || !*sym->name)
+			continue;
+		fprintf(out, "%s %s %u %u %lu %s",
+			is_mangled_sym(sym) ? "mangled" : "symbol", sym->name,
+			sym->sym.st_info, sym->sym.st_other,
+			(unsigned long)sym->sym.st_size,
+			sym->sec ? sym->sec->name : "-");
+		if (is_mangled_sym(sym))
+			fprintf(out, " %s", referrers[sym->index] ?
+				referrers[sym->index]->name : "-");
+		fprintf(out, "\n");
+	}
+}
+
+struct fingerprint {
+	char *name;
+	char *secname;
+	char *referrer;			/* mangled symbols only */
+	unsigned char info, other;
+	unsigned long size;
+	unsigned long long hash;	/* sections only */
+	int mangled;
+	struct symbol *twin;
+};
+
+struct fingerprint_db {
+	GElf_Ehdr eh;
+	struct fingerprint *sections, *symbols;
+	int sections_nr, symbols_nr;
+};
+
+int fingerprint_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct fingerprint *)a)->name,
+		      ((const struct fingerprint *)b)->name);
+}
+
+struct fingerprint *find_fingerprint(struct fingerprint *fps, int nr,
+				     char *name)
+{
+	struct fingerprint key = { .name = name };
+
+	return bsearch(&key, fps, nr, sizeof(*fps), fingerprint_cmp);
+}
+
+void kpatch_read_fingerprints(const char *buf, size_t size,
+			      struct fingerprint_db *db)
+{
+	char *copy, *line, *next, *field, *fields[11], *save, *end;
+	struct fingerprint *fp;
+	int nr, i, lineno = 0;
+
+	memset(db, 0, sizeof(*db));
+
+	copy = kpatch_strndup(buf, size);
+	nr = 1;
+	for (line = copy; (line = strchr(line, '\n')); line++)
+		nr++;
+	db->sections = kpatch_alloc(nr * sizeof(*db->sections));
+	db->symbols = kpatch_alloc(nr * sizeof(*db->symbols));
+
+	for (line = copy; line && *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+		lineno++;
+
+		nr = 0;
+		for (field = strtok_r(line, " ", &save); field && nr < 11;
+		     field = strtok_r(NULL, " ", &save))
+			fields[nr++] = field;
+
+		if (nr == 11 && !strcmp(fields[0], "elf") &&
+		    strlen(fields[1]) == EI_NIDENT * 2) {
+			for (i = 0; i < EI_NIDENT; i++)
+				sscanf(fields[1] + i * 2, "%2hhx",
+				       &db->eh.e_ident[i]);
+			db->eh.e_type = strtoul(fields[2], NULL, 10);
+			db->eh.e_machine = strtoul(fields[3], NULL, 10);
+			db->eh.e_version = strtoul(fields[4], NULL, 10);
+			db->eh.e_entry = strtoul(fields[5], NULL, 10);
+			db->eh.e_phoff = strtoul(fields[6], NULL, 10);
+			db->eh.e_flags = strtoul(fields[7], NULL, 10);
+			db->eh.e_ehsize = strtoul(fields[8], NULL, 10);
+			db->eh.e_phentsize = strtoul(fields[9], NULL, 10);
+			db->eh.e_shentsize = strtoul(fields[10], NULL, 10);
+		} else if (nr == 3 && !strcmp(fields[0], "section")) {
+			fp = &db->sections[db->sections_nr++];
+			fp->name = fields[1];
+			fp->hash = strtoull(fields[2], &end, 16);
+			if (*end)
+				ERROR("bad fingerprint database line %d",
+				      lineno);
+		} else if ((nr == 6 && !strcmp(fields[0], "symbol")) ||
+			   (nr == 7 && !strcmp(fields[0], "mangled"))) {
+			fp = &db->symbols[db->symbols_nr++];
+			fp->name = fields[1];
+			fp->info = strtoul(fields[2], NULL, 10);
+			fp->other = strtoul(fields[3], NULL, 10);
+			fp->size = strtoul(fields[4], NULL, 10);
+			fp->secname = strcmp(fields[5], "-") ? fields[5] : NULL;
+			if (nr == 7) {
+				fp->mangled = 1;
+				fp->referrer = strcmp(fields[6], "-") ?
+					       fields[6] : NULL;
+			}
+		} else
+			ERROR("bad fingerprint database line %d", lineno);
+	}
+
+	if (!db->eh.e_ident[EI_MAG0])
+		ERROR("fingerprint database has no ELF header");
+
+	qsort(db->sections, db->sections_nr, sizeof(*db->sections),
+	      fingerprint_cmp);
+	qsort(db->symbols, db->symbols_nr, sizeof(*db->symbols),
+	      fingerprint_cmp);
+}
+
+int kpatch_mangled_fingerprint_matches(struct fingerprint *fp,
+				       struct symbol *sym,
+				       struct symbol **referrers)
+{
+	struct symbol *func;
+
+	if (!fp->mangled || fp->twin || fp->info != sym->sym.st_info ||
+	    mangled_strcmp(fp->name, sym->name))
+		return 0;
+
+	if (sym->type == STT_FUNC)
+		return 1;
+
+	func = referrers[sym->index];
+	if (!func || !fp->referrer)
+		return !func && !fp->referrer;
+
+	return !mangled_strcmp(fp->referrer, func->name);
+}
+
+void kpatch_correlate_mangled_fingerprint(struct fingerprint *fp,
+					  struct symbol *sym,
+					  struct fingerprint **twins)
+{
+	struct section *sec = sym->sec;
+	char *name;
+	size_t len;
+
+	log_debug("correlating %s with %s\n", fp->name, sym->name);
+
+	fp->twin = sym;
+	twins[sym->index] = fp;
+
+	/* ".rela.data.foo.1" becomes ".rela" plus the new section name */
+	if (sec->rela) {
+		len = strlen(sec->rela->name) - strlen(sec->name);
+		name = kpatch_alloc(len + strlen(fp->secname) + 1);
+		memcpy(name, sec->rela->name, len);
+		strcpy(name + len, fp->secname);
+		sec->rela->name = name;
+	}
+
+	sym->name = fp->name;
+	sec->name = fp->secname;
+	if (sec->secsym)
+		sec->secsym->name = sec->name;
+}
+
+/*
+ * Correlate the mangled symbols of the patched object with those in the
+ * fingerprint database, using the same rules as
+ * kpatch_correlate_mangled_symbols() with the section fingerprints
+ * standing in for the base sections.
+ */
+void kpatch_correlate_mangled_fingerprints(struct kpatch_elf *kelf,
+					   struct fingerprint_db *db,
+					   struct fingerprint **twins)
+{
+	struct symbol **referrers, *sym, *match;
+	struct fingerprint *fp, *secfp;
+	unsigned long long *hashes;
+	int i, j, k, nr, pass;
+
+	referrers = kpatch_find_mangled_referrers(kelf);
+	hashes = kpatch_alloc(kelf->symbols.nr * sizeof(*hashes));
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (i && is_mangled_sym(sym))
+			hashes[i] = kpatch_section_fingerprint(sym->sec);
+
+	/* pass 0: identical and same name, 1: identical, 2: unique */
+	for (pass = 0; pass < 3; pass++) {
+		for (i = 0; i < db->symbols_nr; i++) {
+			fp = &db->symbols[i];
+			if (!fp->mangled || fp->twin)
+				continue;
+			secfp = find_fingerprint(db->sections,
+						 db->sections_nr, fp->secname);
+
+			match = NULL;
+			nr = 0;
+			for_each_symbol(j, sym, &kelf->symbols) {
+				if (j == 0 || twins[j] || !is_mangled_sym(sym) ||
+				    !kpatch_mangled_fingerprint_matches(fp, sym,
+								referrers))
+					continue;
+				nr++;
+				if (pass == 2) {
+					match = sym;
+					continue;
+				}
+				if ((pass == 0 && strcmp(fp->name, sym->name)) ||
+				    !secfp || secfp->hash != hashes[j])
+					continue;
+				match = sym;
+				break;
+			}
+
+			if (pass == 2 && match) {
+				if (nr != 1)
+					continue;
+				nr = 0;
+				for (k = 0; k < db->symbols_nr; k++)
+					if (kpatch_mangled_fingerprint_matches(
+						&db->symbols[k], match,
+						referrers))
+						nr++;
+				if (nr != 1)
+					continue;
+			}
+
+			if (match)
+				kpatch_correlate_mangled_fingerprint(fp, match,
+								     twins);
+		}
+	}
+}
+
+struct fingerprint *kpatch_symbol_fingerprint(struct symbol *sym,
+					      struct fingerprint_db *db,
+					      struct fingerprint **twins)
+{
+	if (is_mangled_sym(sym))
+		return twins[sym->index];
+	if (sym->type == STT_SECTION && is_mangled_section(sym->sec) &&
+	    !twins[sym->sec->sym->index])
+		return NULL;
+
+	return find_fingerprint(db->symbols, db->symbols_nr, sym->name);
+}
+
+/*
+ * Set the status of the patched object's sections and symbols by comparing
+ * them with the fingerprint database, in place of kpatch_correlate_elfs()
+ * and kpatch_compare_correlated_elements().
+ */
+void kpatch_compare_fingerprints(struct kpatch_elf *kelf,
+				 struct fingerprint_db *db)
+{
+	struct fingerprint **twins, *fp;
+	struct section *sec;
+	struct symbol *sym;
+	GElf_Ehdr eh;
+	int i;
+
+	if (!gelf_getehdr(kelf->elf, &eh))
+		ERROR("gelf_getehdr");
+	kpatch_compare_ehdrs(&db->eh, &eh);
+
+	twins = kpatch_alloc(kelf->symbols.nr * sizeof(*twins));
+	kpatch_correlate_mangled_fingerprints(kelf, db, twins);
+
+	/* set initial status, might change */
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (i)
+			sym->status = kpatch_symbol_fingerprint(sym, db, twins) ?
+				      SAME : NEW;
+
+	for_each_section(i, sec, &kelf->sections) {
+		if (is_rela_section(sec))
+			continue;
+
+		if (is_mangled_section(sec) && !twins[sec->sym->index])
+			fp = NULL;
+		else
+			fp = find_fingerprint(db->sections, db->sections_nr,
+					      sec->name);
+
+		if (!fp)
+			sec->status = NEW;
+		else if (fp->hash == kpatch_section_fingerprint(sec))
+			sec->status = SAME;
+		else
+			sec->status = CHANGED;
+
+		/* the fingerprint covers the relas too */
+		if (sec->sym)
+			sec->sym->status = sec->status;
+		if (sec->secsym)
+			sec->secsym->status = sec->status;
+		if (sec->rela)
+			sec->rela->status = sec->status;
+	}
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0)
+			continue;
+
+		fp = kpatch_symbol_fingerprint(sym, db, twins);
+		if (!fp) {
+			sym->status = NEW;
+			continue;
+		}
+
+		if (fp->info != sym->sym.st_info ||
+		    fp->other != sym->sym.st_other ||
+		    !fp->secname != !sym->sec ||
+		    (sym->sec && strcmp(fp->secname, sym->sec->name)))
+			DIFF_FATAL("symbol info mismatch: %s", sym->name);
+
+		if (sym->type == STT_OBJECT && fp->size != sym->sym.st_size)
+			DIFF_FATAL("object size mismatch: %s", sym->name);
+
+		if (sym->sym.st_shndx == SHN_UNDEF ||
+		    sym->sym.st_shndx == SHN_ABS)
+			sym->status = SAME;
+
+		log_debug("symbol %s is %s\n", sym->name,
+			  status_str(sym->status));
+	}
+
+	kpatch_sync_child_functions(kelf);
+}
+
+void kpatch_replace_sections_syms(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	struct rela *rela;
+	int i, j;
+
+	for_each_section(i, sec, &kelf->sections) {
+		if (!is_rela_section(sec))
+			continue;
+
+		for_each_rela(j, rela, &sec->relas) {
+			if (rela->sym->type != STT_SECTION ||
+			    !rela->sym->sec || !rela->sym->sec->sym)
+				continue;
+
+			log_debug("replacing %s with %s\n",
+			       rela->sym->name, rela->sym->sec->sym->name);
+
+			rela->sym = rela->sym->sec->sym;
+		}
+	}
+}
+
+void kpatch_dump_kelf(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	struct symbol *sym;
+	struct rela *rela;
+	int i, j;
+
+	if (loglevel > DEBUG)
+		return;
+
+	log_debug("\n=== Sections ===\n");
+	for_each_section(i, sec, &kelf->sections) {
+		log_debug("%02d %s (%s)", sec->index, sec->name, status_str(sec->status));
+		if (is_rela_section(sec)) {
+			log_debug(", base-> %s\n", sec->base->name);
+			log_debug("rela section expansion\n");
+			for_each_rela(j, rela, &sec->relas) {
+				log_debug("sym %lu, offset %d, type %d, %s %s %d %s\n",
+					  GELF_R_SYM(rela->rela.r_info),
+					  rela->offset, rela->type,
+					  rela->sym->name,
+					  (rela->addend < 0)?"-":"+",
+					  abs(rela->addend),
+					  status_str(rela->status));
+			}
+		} else {
+			if (sec->sym)
+				log_debug(", sym-> %s", sec->sym->name);
+			if (sec->secsym)
+				log_debug(", secsym-> %s", sec->secsym->name);
+			if (sec->rela)
+				log_debug(", rela-> %s", sec->rela->name);
+		}
+		log_debug("\n");
+	}
+
+	log_debug("\n=== Symbols ===\n");
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0) /* ugh */
+			continue;
+		log_debug("sym %02d, type %d, bind %d, ndx %02d, name %s (%s)",
+			sym->index, sym->type, sym->bind, sym->sym.st_shndx,
+			sym->name, status_str(sym->status));
+		if (sym->sec && (sym->type == STT_FUNC || sym->type == STT_OBJECT))
+			log_debug(" -> %s", sym->sec->name);
+		log_debug("\n");
+	}
+}
+
+int kpatch_find_changed_functions(struct kpatch_elf *kelf)
+{
+	struct symbol *sym;
+	int i, changed = 0;
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (sym->type != STT_FUNC || sym->parent)
+			continue;
+		if (sym->status == CHANGED) {
+			changed = 1;
+			log_normal("function %s has changed\n",sym->name);
+		}
+	}
+
+	if (!changed)
+		log_normal("no changes found\n");
+			
+	return changed;
+}
+
+#define inc_printf(fmt, ...) \
+	log_debug("%*s" fmt, recurselevel, "", ##__VA_ARGS__);
+
+void kpatch_include_symbol(struct symbol *sym, int recurselevel)
+{
+	struct rela *rela;
+	struct section *sec;
+	int i;
+
+	inc_printf("start include_symbol(%s)\n", sym->name);
+	sym->include = 1;
+	inc_printf("symbol %s is included\n", sym->name);
+	/*
+	 * Check if sym is a non-local symbol (sym->sec is NULL) or
+	 * if an unchanged local symbol.  This a base case for the
+	 * inclusion recursion.
+	 */
+	if (!sym->sec || (sym->type != STT_SECTION && sym->status == SAME))
+		goto out;
+	sec = sym->sec;
+	sec->include = 1;
+	inc_printf("section %s is included\n", sec->name);
+	if (sec->secsym && sec->secsym != sym) {
+		sec->secsym->include = 1;
+		inc_printf("section symbol %s is included\n", sec->secsym->name);
+	}
+	if (!sec->rela)
+		goto out;
+	sec->rela->include = 1;
+	inc_printf("section %s is included\n", sec->rela->name);
+	for_each_rela(i, rela, &sec->rela->relas) {
+		if (rela->sym->include)
+			continue;
+		kpatch_include_symbol(rela->sym, recurselevel+1);
+	}
+	if (sym->child && !sym->child->include)
+		kpatch_include_symbol(sym->child, recurselevel+1);
+out:
+	inc_printf("end include_symbol(%s)\n", sym->name);
+	return;
+}
+
+void kpatch_include_changed_functions(struct kpatch_elf *kelf)
+{
+	struct symbol *sym;
+	int i;
+
+	log_debug("\n=== Inclusion Tree ===\n");
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (sym->status == CHANGED &&
+		    sym->type == STT_FUNC &&
+		    !sym->parent &&
+		    !sym->include) {
+			log_normal("changed function: %s\n", sym->name);
+			kpatch_include_symbol(sym, 0);
+		}
+
+		if (sym->type == STT_FILE)
+			sym->include = 1;
+	}
+}
+
+/*
+ * Special sections are arrays of fixed size entries ("groups") which refer
+ * to code in other sections, e.g. the __jump_table entries for static
+ * branches.  Only the groups which refer to included functions are kept.
+ */
+struct special_section {
+	char *name;
+	int (*group_size)(struct section *sec);
+};
+
+/*
+ * Work out the size of the entries of a special section from the distance
+ * between the relas of consecutive entries, given the number of relas each
+ * entry has.  The size of the entries has changed between kernel versions.
+ */
+int rela_stride_group_size(struct section *sec, int relas_per_group)
+{
+	struct rela *relas;
+
+	if (!sec->rela || sec->rela->relas.nr < relas_per_group)
+		ERROR("%s has no relas", sec->name);
+
+	if (sec->rela->relas.nr == relas_per_group)
+		return sec->sh.sh_size;
+
+	relas = sec->rela->relas.data;
+	return relas[relas_per_group].offset - relas[0].offset;
+}
+
+/* struct alt_instr: instruction and replacement offsets, then flags */
+int altinstructions_group_size(struct section *sec)
+{
+	return rela_stride_group_size(sec, 2);
+}
+
+/* struct paravirt_patch_site: instruction pointer, then type and length */
+int parainstructions_group_size(struct section *sec)
+{
+	return rela_stride_group_size(sec, 1);
+}
+
+/*
+ * struct jump_entry is three absolute pointers (code, target, key), or
+ * three 32-bit relative offsets on kernels with relative jump labels.
+ */
+int jump_table_group_size(struct section *sec)
+{
+	struct rela *rela;
+
+	if (!sec->rela || !sec->rela->relas.nr)
+		return 24;
+
+	rela = &((struct rela *)sec->rela->relas.data)[0];
+	if (rela->type == R_X86_64_PC32)
+		return 16;
+
+	return 24;
+}
+
+static struct special_section special_sections[] = {
+	{ "__jump_table", jump_table_group_size },
+	{ ".altinstructions", altinstructions_group_size },
+	{ ".parainstructions", parainstructions_group_size },
+	{ NULL, NULL }
+};
+
+int should_keep_rela(struct rela *rela)
+{
+	return rela->sym->type == STT_FUNC && rela->sym->sec &&
+	       rela->sym->sec->include;
+}
+
+void kpatch_regenerate_special_section(struct special_section *special,
+				       struct section *sec)
+{
+	struct rela *rela, *relas;
+	struct section *relasec = sec->rela;
+	char *keep, *buf;
+	size_t groups_nr, group, src, dest = 0, size, relas_nr = 0;
+	int i, group_size;
+
+	group_size = special->group_size(sec);
+	if (group_size <= 0)
+		ERROR("%s has invalid entry size %d", sec->name, group_size);
+
+	/* the last entry may lack the padding up to the next one */
+	groups_nr = (sec->sh.sh_size + group_size - 1) / group_size;
+	keep = kpatch_alloc(groups_nr);
+	memset(keep, 0, groups_nr);
+
+	/* find the groups which refer to included functions */
+	for_each_rela(i, rela, &relasec->relas) {
+		group = rela->offset / group_size;
+		if (group >= groups_nr)
+			ERROR("%s rela at offset %d is past the end of the section",
+			      sec->name, rela->offset);
+		if (should_keep_rela(rela))
+			keep[group] = 1;
+	}
+
+	for_each_rela(i, rela, &relasec->relas)
+		if (keep[rela->offset / group_size])
+			relas_nr++;
+
+	if (!relas_nr)
+		return;
+
+	/* copy the kept groups and their relas */
+	size = 0;
+	for (group = 0; group < groups_nr; group++)
+		if (keep[group])
+			size += group_size;
+	if (keep[groups_nr - 1])
+		size -= groups_nr * group_size - sec->sh.sh_size;
+
+	buf = kpatch_alloc(size);
+	relas = kpatch_alloc(relas_nr * sizeof(*relas));
+	memset(relas, 0, relas_nr * sizeof(*relas));
+
+	for (group = 0; group < groups_nr; group++) {
+		if (!keep[group])
+			continue;
+
+		src = group * group_size;
+		memcpy(buf + dest, sec->data->d_buf + src,
+		       group == groups_nr - 1 ? sec->sh.sh_size - src :
+		       group_size);
+
+		for_each_rela(i, rela, &relasec->relas) {
+			if (rela->offset / group_size != group)
+				continue;
+			*relas = *rela;
+			relas->offset += dest - src;
+			relas->rela.r_offset = relas->offset;
+			relas++;
+		}
+
+		dest += group_size;
+	}
+	relas -= relas_nr;
+
+	log_debug("%s: kept %zu of %zu bytes\n", sec->name, size,
+		  sec->sh.sh_size);
+
+
+	sec->data->d_buf = buf;
+	sec->data->d_size = size;
+	sec->sh.sh_size = size;
+
+	relasec->relas.data = relas;
+	relasec->relas.nr = relas_nr;
+	relasec->sh.sh_size = relas_nr * relasec->sh.sh_entsize;
+	relasec->data->d_size = relasec->sh.sh_size;
+
+	/* include the special section along with everything it refers to */
+	sec->include = 1;
+	if (sec->secsym)
+		sec->secsym->include = 1;
+	relasec->include = 1;
+	for_each_rela(i, rela, &relasec->relas)
+		if (!rela->sym->include)
+			kpatch_include_symbol(rela->sym, 0);
+}
+
+void kpatch_process_special_sections(struct kpatch_elf *kelf)
+{
+	struct special_section *special;
+	struct section *sec;
+
+	for (special = special_sections; special->name; special++) {
+		sec = find_section_by_name(&kelf->sections, special->name);
+		if (!sec || !sec->rela)
+			continue;
+
+		kpatch_regenerate_special_section(special, sec);
+	}
+}
+
+int kpatch_copy_symbols(int startndx, struct kpatch_elf *src,
+                        struct kpatch_elf *dst,
+                        int (*select)(struct symbol *))
+{
+	struct symbol *srcsym, *dstsym;
+	int i, index = startndx;
+
+	for_each_symbol(i, srcsym, &src->symbols) {
+		if (i == 0 || !srcsym->include)
+			continue;
+
+		if (select && !select(srcsym))
+			continue;
+
+		dstsym = &((struct symbol *)(dst->symbols.data))[index];
+		*dstsym = *srcsym;
+		dstsym->index = index;
+		dstsym->twino = srcsym;
+		srcsym->twino = dstsym;
+		index++;
+
+		if (srcsym->sec && srcsym->sec->twino) {
+			if (srcsym->sec->twino->index >= SHN_LORESERVE)
+				dstsym->sym.st_shndx = SHN_XINDEX;
+			else
+				dstsym->sym.st_shndx = srcsym->sec->twino->index;
+		}
+
+		srcsym->include = 0;
+	}
+
+	return index;
+}
+
+int is_file_sym(struct symbol *sym)
+{
+	return sym->type == STT_FILE;
+}
+
+int is_local_func_sym(struct symbol *sym)
+{
+	return sym->bind == STB_LOCAL && sym->type == STT_FUNC;
+}
+
+int is_local_sym(struct symbol *sym)
+{
+	return sym->bind == STB_LOCAL;
+}
+
+int is_cold_section(struct section *sec)
+{
+	if (is_rela_section(sec))
+		sec = sec->base;
+
+	return sec->sym && sec->sym->parent;
+}
+
+/*
+ * An optional profile, with lines of the form "<count> <symbol>", e.g. the
+ * output of "perf script -F sym | sort | uniq -c", tells which of the
+ * replacement functions are hot.
+ */
+struct profile_entry {
+	char *name;
+	unsigned long count;
+};
+
+static __thread struct profile_entry *profile;
+static __thread size_t profile_nr;
+static __thread unsigned long profile_total;
+
+/* functions with at least this share of the samples are aligned */
+#define HOT_THRESHOLD_PERCENT 1
+#define HOT_FUNCTION_ALIGN 64
+
+int profile_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((struct profile_entry *)a)->name,
+		      ((struct profile_entry *)b)->name);
+}
+
+void kpatch_read_profile(const char *buf, size_t size)
+{
+	char *text, *line, *end, name[512];
+	unsigned long count;
+	size_t lines = 1, i, j;
+
+	text = kpatch_strndup(buf, size);
+	for (line = text; (line = strchr(line, '\n')); line++)
+		lines++;
+	profile = kpatch_alloc(lines * sizeof(*profile));
+
+	for (line = text; line; line = end) {
+		end = strchr(line, '\n');
+		if (end)
+			*end++ = '\0';
+		if (sscanf(line, "%lu %511s", &count, name) != 2)
+			continue;
+		profile[profile_nr].name = kpatch_strdup(name);
+		profile[profile_nr++].count = count;
+		profile_total += count;
+	}
+
+	/* sort for lookups, merging any duplicate entries */
+	qsort(profile, profile_nr, sizeof(*profile), profile_entry_cmp);
+	for (i = 0, j = 0; i < profile_nr; i++) {
+		if (j && !strcmp(profile[j - 1].name, profile[i].name))
+			profile[j - 1].count += profile[i].count;
+		else
+			profile[j++] = profile[i];
+	}
+	profile_nr = j;
+}
+
+unsigned long profile_count(struct symbol *sym)
+{
+	struct profile_entry key, *entry;
+
+	if (!profile_nr)
+		return 0;
+
+	key.name = sym->name;
+	entry = bsearch(&key, profile, profile_nr, sizeof(*profile),
+			profile_entry_cmp);
+
+	return entry ? entry->count : 0;
+}
+
+int is_hot(unsigned long count)
+{
+	return profile_total &&
+	       count * 100 >= profile_total * HOT_THRESHOLD_PERCENT;
+}
+
+struct call_edge {
+	int from, to;
+	unsigned long weight;
+};
+
+int call_edge_cmp(const void *a, const void *b)
+{
+	const struct call_edge *edge1 = a, *edge2 = b;
+
+	if (edge1->from != edge2->from)
+		return edge1->from - edge2->from;
+	return edge1->to - edge2->to;
+}
+
+int call_edge_weight_cmp(const void *a, const void *b)
+{
+	const struct call_edge *edge1 = a, *edge2 = b;
+
+	if (edge1->weight != edge2->weight)
+		return edge1->weight < edge2->weight ? 1 : -1;
+	return call_edge_cmp(a, b);
+}
+
+struct function_chain {
+	int head, first;
+	unsigned long count;
+};
+
+int function_chain_cmp(const void *a, const void *b)
+{
+	const struct function_chain *chain1 = a, *chain2 = b;
+
+	if (chain1->count != chain2->count)
+		return chain1->count < chain2->count ? 1 : -1;
+	return chain1->first - chain2->first;
+}
+
+/*
+ * Rank the included function sections so that functions which call each
+ * other are laid out next to each other, using the greedy chain merging of
+ * Pettis and Hansen.  The affinity of two functions is the number of
+ * relocations between them, scaled by their profile counts if a profile
+ * was given.  Chains of functions are then ordered hottest first, and the
+ * hot functions are aligned to cache lines.  All ties are broken by section
+ * index, so the layout is deterministic.
+ */
+void kpatch_order_functions(struct kpatch_elf *kelf)
+{
+	struct section *sec, **funcs;
+	struct symbol *sym;
+	struct rela *rela;
+	struct call_edge *edges;
+	struct function_chain *chains;
+	int *head, *tail, *next, funcs_nr = 0, edges_nr = 0, chains_nr = 0;
+	int i, j, from, to, rank = 0;
+	unsigned long *counts, count;
+
+	funcs = kpatch_alloc(kelf->sections.nr * sizeof(*funcs));
+
+	for_each_section(i, sec, &kelf->sections) {
+		sec->rank = 0;
+		if (!sec->include || is_rela_section(sec) ||
+		    !sec->sym || sec->sym->type != STT_FUNC ||
+		    is_cold_section(sec))
+			continue;
+		sec->rank = funcs_nr;
+		funcs[funcs_nr++] = sec;
+	}
+
+	if (!funcs_nr)
+		return;
+
+	counts = kpatch_alloc(funcs_nr * sizeof(*counts));
+	head = kpatch_alloc(funcs_nr * sizeof(*head));
+	tail = kpatch_alloc(funcs_nr * sizeof(*tail));
+	next = kpatch_alloc(funcs_nr * sizeof(*next));
+	chains = kpatch_alloc(funcs_nr * sizeof(*chains));
+
+	for (i = 0; i < funcs_nr; i++) {
+		counts[i] = profile_count(funcs[i]->sym);
+		head[i] = tail[i] = i;
+		next[i] = -1;
+
+		if (is_hot(counts[i]) &&
+		    funcs[i]->sh.sh_addralign < HOT_FUNCTION_ALIGN) {
+			log_debug("aligning hot function %s\n",
+				  funcs[i]->sym->name);
+			funcs[i]->sh.sh_addralign = HOT_FUNCTION_ALIGN;
+		}
+	}
+
+	/* find the calls between included functions */
+	for (i = 0; i < funcs_nr; i++) {
+		if (!funcs[i]->rela)
+			continue;
+		edges_nr += funcs[i]->rela->relas.nr;
+	}
+	edges = kpatch_alloc((edges_nr ? edges_nr : 1) * sizeof(*edges));
+
+	edges_nr = 0;
+	for (i = 0; i < funcs_nr; i++) {
+		if (!funcs[i]->rela)
+			continue;
+		for_each_rela(j, rela, &funcs[i]->rela->relas) {
+			sym = rela->sym;
+			if (sym->type != STT_FUNC || !sym->sec ||
+			    sym->sec == funcs[i] || !sym->sec->include ||
+			    is_rela_section(sym->sec) || sym->sec->sym != sym ||
+			    is_cold_section(sym->sec))
+				continue;
+			from = i < sym->sec->rank ? i : sym->sec->rank;
+			to = i < sym->sec->rank ? sym->sec->rank : i;
+			edges[edges_nr].from = from;
+			edges[edges_nr].to = to;
+			edges[edges_nr++].weight = 1;
+		}
+	}
+
+	/* merge the edges between the same functions */
+	qsort(edges, edges_nr, sizeof(*edges), call_edge_cmp);
+	for (i = 0, j = 0; i < edges_nr; i++) {
+		if (j && !call_edge_cmp(&edges[j - 1], &edges[i]))
+			edges[j - 1].weight++;
+		else
+			edges[j++] = edges[i];
+	}
+	edges_nr = j;
+
+	for (i = 0; i < edges_nr; i++) {
+		count = counts[edges[i].from] < counts[edges[i].to] ?
+			counts[edges[i].from] : counts[edges[i].to];
+		edges[i].weight *= count + 1;
+	}
+
+	/* join chains along the heaviest edges first */
+	qsort(edges, edges_nr, sizeof(*edges), call_edge_weight_cmp);
+	for (i = 0; i < edges_nr; i++) {
+		from = head[edges[i].from];
+		to = head[edges[i].to];
+		if (from == to)
+			continue;
+
+		next[tail[from]] = to;
+		tail[from] = tail[to];
+		for (j = to; j != -1; j = next[j])
+			head[j] = from;
+	}
+
+	/* order the chains, hottest first */
+	for (i = 0; i < funcs_nr; i++) {
+		if (head[i] != i)
+			continue;
+		chains[chains_nr].head = i;
+		chains[chains_nr].first = i;
+		chains[chains_nr].count = 0;
+		for (j = i; j != -1; j = next[j]) {
+			chains[chains_nr].count += counts[j];
+			if (j < chains[chains_nr].first)
+				chains[chains_nr].first = j;
+		}
+		chains_nr++;
+	}
+	qsort(chains, chains_nr, sizeof(*chains), function_chain_cmp);
+
+	for (i = 0; i < chains_nr; i++) {
+		for (j = chains[i].head; j != -1; j = next[j]) {
+			log_debug("function layout: %s\n", funcs[j]->sym->name);
+			funcs[j]->rank = rank++;
+		}
+	}
+
+}
+
+/*
+ * Function sections come first in the order picked by
+ * kpatch_order_functions(), followed by the other sections and finally the
+ * cold parts of functions, which are kept out of the way of the hot code.
+ * Rela sections follow their base sections.
+ */
+int output_section_class(struct section *sec)
+{
+	struct section *base = is_rela_section(sec) ? sec->base : sec;
+
+	if (is_cold_section(base))
+		return 2;
+	if (base->sym && base->sym->type == STT_FUNC)
+		return 0;
+	return 1;
+}
+
+int output_section_cmp(const void *a, const void *b)
+{
+	struct section *sec1 = *(struct section **)a;
+	struct section *sec2 = *(struct section **)b;
+	struct section *base1 = is_rela_section(sec1) ? sec1->base : sec1;
+	struct section *base2 = is_rela_section(sec2) ? sec2->base : sec2;
+	int class1 = output_section_class(sec1);
+	int class2 = output_section_class(sec2);
+
+	if (class1 != class2)
+		return class1 - class2;
+	if (class1 == 0 && base1->rank != base2->rank)
+		return base1->rank - base2->rank;
+	if (base1 != base2)
+		return base1->index - base2->index;
+	return is_rela_section(sec1) - is_rela_section(sec2);
+}
+
+void kpatch_generate_output(struct kpatch_elf *kelf, struct kpatch_elf **kelfout)
+{
+	int sections_nr = 0, symbols_nr = 0, i, index;
+	struct section *sec, *secout, **order;
+	struct symbol *sym;
+	struct kpatch_elf *out;
+
+	/* count output sections */
+	for_each_section(i, sec, &kelf->sections) {
+		/* include these sections even if they haven't changed */
+		if (!strcmp(sec->name, ".shstrtab") ||
+		     !strcmp(sec->name, ".strtab") ||
+		     !strcmp(sec->name, ".symtab"))
+			sec->include = 1;
+
+		if (sec->include)
+			sections_nr++;
+	}
+
+	/* extended section indexes are needed for the output symbols too */
+	if (sections_nr + 1 >= SHN_LORESERVE) {
+		for_each_section(i, sec, &kelf->sections) {
+			if (sec->sh.sh_type == SHT_SYMTAB_SHNDX) {
+				sec->include = 1;
+				sections_nr++;
+				break;
+			}
+		}
+	}
+
+	log_debug("outputting %d sections\n",sections_nr);
+
+	/* count output symbols */
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0 || sym->include)
+			symbols_nr++;
+	}
+
+	log_debug("outputting %d symbols\n",symbols_nr);
+
+	/* allocate output kelf */
+	out = kpatch_alloc(sizeof(*out));
+	memset(out, 0, sizeof(*out));
+
+	/* allocate tables */
+	alloc_table(&out->sections, sizeof(struct section), sections_nr);
+	alloc_table(&out->symbols, sizeof(struct symbol), symbols_nr);
+
+	/* copy to output kelf sections, link to kelf, and reindex */
+	order = kpatch_alloc(sections_nr * sizeof(*order));
+	index = 0;
+	for_each_section(i, sec, &kelf->sections)
+		if (sec->include)
+			order[index++] = sec;
+
+	kpatch_order_functions(kelf);
+	qsort(order, sections_nr, sizeof(*order), output_section_cmp);
+
+	for (index = 0; index < sections_nr; index++) {
+		sec = order[index];
+		secout = &((struct section *)(out->sections.data))[index];
+		*secout = *sec;
+		secout->index = index + 1;
+		secout->twino = sec;
+		sec->twino = secout;
+	}
+
+	/*
+	 * Search symbol table for local functions and objects whose sections
+	 * are not included, and modify them to be non-local.
+	 */
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0)
+			continue;
+		if ((sym->type == STT_OBJECT ||
+		     sym->type == STT_FUNC) &&
+		    !sym->sec->include) {
+			sym->type = STT_NOTYPE;
+			sym->bind = STB_GLOBAL;
+			sym->sym.st_info = GELF_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+			sym->sym.st_shndx = SHN_UNDEF;
+			sym->sym.st_size = 0;
+		}
+	}
+
+	/*
+	 * Copy functions to the output kelf and reindex.  Once the symbol is
+	 * copied, its include field is set to zero so it isn't copied again
+	 * by a subsequent kpatch_copy_symbols() call.
+	 */
+	/* start at 1 to skip over symbol 0 (all zeros) */
+	index = 1;
+	/* copy (LOCAL) FILE sym */
+	index = kpatch_copy_symbols(index, kelf, out, is_file_sym);
+	/* copy LOCAL FUNC syms */
+	index = kpatch_copy_symbols(index, kelf, out, is_local_func_sym);
+	/* copy all other LOCAL syms */
+	index = kpatch_copy_symbols(index, kelf, out, is_local_sym);
+	/* copy all other (GLOBAL) syms */
+	index = kpatch_copy_symbols(index, kelf, out, NULL);
+
+	*kelfout = out;
+}
+
+/*
+ * Only the strings which are referred to by the included relas are needed
+ * in the output object.  Rebuild the merged string section with just those
+ * strings and adjust the rela addends to match.  The section is left alone
+ * if anything other than its section symbol refers to it.
+ */
+void kpatch_compact_string_section(struct kpatch_elf *kelf,
+				   struct section *strsec)
+{
+	struct section *sec;
+	struct symbol *sym;
+	struct rela *rela;
+	char *buf, *str;
+	size_t size = 0, offset = 0, len;
+	long oldoffset;
+	int i, j;
+
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (i && sym->sec == strsec->twino && sym->type != STT_SECTION)
+			return;
+
+	for_each_section(i, sec, &kelf->sections) {
+		if (!is_rela_section(sec))
+			continue;
+		for_each_rela(j, rela, &sec->relas) {
+			if (rela->sym->sec != strsec->twino)
+				continue;
+			if (!rela->string)
+				return;
+			size += strlen(rela->string) + 1;
+		}
+	}
+
+	if (!size)
+		return;
+
+	buf = kpatch_alloc(size);
+	memset(buf, 0, size);
+
+	for_each_section(i, sec, &kelf->sections) {
+		if (!is_rela_section(sec))
+			continue;
+		for_each_rela(j, rela, &sec->relas) {
+			if (rela->sym->sec != strsec->twino)
+				continue;
+
+			/* reuse the string if it's already been added */
+			for (str = buf; str < buf + offset; str += strlen(str) + 1)
+				if (!strcmp(str, rela->string))
+					break;
+			if (str == buf + offset) {
+				len = strlen(rela->string) + 1;
+				memcpy(str, rela->string, len);
+				offset += len;
+			}
+
+			oldoffset = rela->string - (char *)strsec->data->d_buf;
+			rela->addend += (str - buf) - oldoffset;
+			rela->rela.r_addend = rela->addend;
+		}
+	}
+
+	log_debug("%s: compacted from %zu to %zu bytes\n", strsec->name,
+		  strsec->data->d_size, offset);
+
+	strsec->data->d_buf = buf;
+	strsec->data->d_size = offset;
+	strsec->sh.sh_size = offset;
+}
+
+void kpatch_compact_string_sections(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	int i;
+
+	for_each_section(i, sec, &kelf->sections)
+		if ((sec->sh.sh_flags & SHF_STRINGS) &&
+		    sec->sh.sh_entsize == 1)
+			kpatch_compact_string_section(kelf, sec);
+}
+
+void kpatch_write_inventory(struct kpatch_elf *kelf, FILE *out)
+{
+	int i;
+	struct section *sec;
+	struct symbol *sym;
+
+	for_each_section(i, sec, &kelf->sections)
+		fprintf(out, "section %s\n", sec->name);
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0)
+			continue;
+		fprintf(out, "symbol %s %d %d\n", sym->name, sym->type, sym->bind);
+	}
+}
+
+/*
+ * On x86, calls and tail calls show up as PC relative relas right after a
+ * call or jmp opcode.  Jumps between a function and its cold part don't
+ * count.
+ */
+int kpatch_section_has_calls(struct section *sec, struct symbol *func)
+{
+	struct rela *rela;
+	unsigned char *buf = sec->data->d_buf;
+	int i;
+
+	if (!sec->rela)
+		return 0;
+
+	for_each_rela(i, rela, &sec->rela->relas) {
+		if (rela->sym == func || rela->sym == func->child)
+			continue;
+		if ((rela->type == R_X86_64_PC32 ||
+		     rela->type == R_X86_64_PLT32) &&
+		    rela->offset > 0 &&
+		    (buf[rela->offset - 1] == 0xe8 ||
+		     buf[rela->offset - 1] == 0xe9))
+			return 1;
+	}
+
+	return 0;
+}
+
+int kpatch_is_leaf_function(struct symbol *sym)
+{
+	if (kpatch_section_has_calls(sym->sec, sym))
+		return 0;
+	if (sym->child && kpatch_section_has_calls(sym->child->sec, sym))
+		return 0;
+	return 1;
+}
+
+/*
+ * Count the symbols a replacement function depends on, directly or through
+ * the other functions and data included in the patch module.  The walk stops
+ * at symbols which are resolved against the running kernel.
+ */
+int kpatch_count_dependencies(struct kpatch_elf *kelf, struct symbol *sym,
+			      int *visited, int stamp, struct symbol **stack)
+{
+	struct symbol *cur, *dep;
+	struct section *sec;
+	struct rela *rela;
+	int i, nr = 0, deps = 0;
+
+	visited[sym->index] = stamp;
+	stack[nr++] = sym;
+	while (nr) {
+		cur = stack[--nr];
+		if (cur->child && visited[cur->child->index] != stamp) {
+			visited[cur->child->index] = stamp;
+			stack[nr++] = cur->child;
+		}
+		sec = cur->sec;
+		if (!sec || !sec->include || !sec->rela)
+			continue;
+		for_each_rela(i, rela, &sec->rela->relas) {
+			dep = rela->sym;
+			if (visited[dep->index] == stamp)
+				continue;
+			visited[dep->index] = stamp;
+			if (dep->type != STT_SECTION)
+				deps++;
+			stack[nr++] = dep;
+		}
+	}
+
+	return deps;
+}
+
+/*
+ * Write a line for each replaced function with the size of its code, the
+ * number of symbols it depends on, whether it's a leaf, and its profile
+ * count, if a profile was given.  kpatch-build adds the stacking depth and
+ * turns this into the report for the whole patch.
+ */
+void kpatch_write_report(struct kpatch_elf *kelf, FILE *out)
+{
+	struct symbol *sym, **stack;
+	unsigned long size, count;
+	int *visited, i, stamp = 0;
+
+	visited = kpatch_alloc(kelf->symbols.nr * sizeof(*visited));
+	stack = kpatch_alloc(kelf->symbols.nr * sizeof(*stack));
+	memset(visited, 0, kelf->symbols.nr * sizeof(*visited));
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (sym->type != STT_FUNC || sym->status != CHANGED ||
+		    sym->parent || !sym->include || !sym->sec)
+			continue;
+
+		size = sym->sym.st_size;
+		if (sym->child)
+			size += sym->child->sym.st_size;
+		count = profile_count(sym);
+
+		fprintf(out, "function %s size %lu deps %d leaf %d samples %lu hot %d\n",
+			sym->name, size,
+			kpatch_count_dependencies(kelf, sym, visited, ++stamp,
+						  stack),
+			kpatch_is_leaf_function(sym), count, is_hot(count));
+	}
+}
+
+void kpatch_create_rela_section(struct section *sec, int link)
+{
+	struct rela *rela;
+	int i, symndx, type;
+	char *buf;
+	size_t size;
+
+	/* create new rela data buffer */
+	size = sec->sh.sh_size;
+	buf = kpatch_alloc(size);
+	memset(buf, 0, size);
+
+	/* reindex and copy into buffer */
+	for_each_rela(i, rela, &sec->relas) {
+		if (!rela->sym || !rela->sym->twino)
+			ERROR("expected rela symbol");
+		symndx = rela->sym->twino->index;
+		type = GELF_R_TYPE(rela->rela.r_info);
+		rela->rela.r_info = GELF_R_INFO(symndx, type);
+
+		memcpy(buf + (i * sec->sh.sh_entsize), &rela->rela,
+		       sec->sh.sh_entsize);
+	}
+
+	sec->data->d_buf = buf;
+	/* size is unchanged */
+
+	sec->sh.sh_link = link;
+	/* info is section index of text section that matches this rela */
+	sec->sh.sh_info = sec->twino->base->twino->index;
+}
+
+void kpatch_create_rela_sections(struct kpatch_elf *kelf)
+{
+	struct section *sec;
+	int i, link;
+
+	link = find_section_by_name(&kelf->sections, ".symtab")->index;
+
+	/* reindex rela symbols */
+	for_each_section(i, sec, &kelf->sections)
+		if (is_rela_section(sec))
+			kpatch_create_rela_section(sec, link);
+}
+
+void print_strtab(char *buf, size_t size)
+{
+	int i;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] == 0)
+			log_debug("\\0");
+		else
+			log_debug("%c",buf[i]);
+	}
+}
+
+void kpatch_create_shstrtab(struct kpatch_elf *kelf)
+{
+	struct section *shstrtab, *sec;
+	size_t size, offset, len;
+	int i;
+	char *buf;
+
+	shstrtab = find_section_by_name(&kelf->sections, ".shstrtab");
+	if (!shstrtab)
+		ERROR("find_section_by_name");
+
+	/* determine size of string table */
+	size = 1; /* for initial NULL terminator */
+	for_each_section(i, sec, &kelf->sections)
+		size += strlen(sec->name) + 1; /* include NULL terminator */
+
+	/* allocate data buffer */
+	buf = kpatch_alloc(size);
+	memset(buf, 0, size);
+
+	/* populate string table and link with section header */
+	offset = 1;
+	for_each_section(i, sec, &kelf->sections) {
+		len = strlen(sec->name) + 1;
+		sec->sh.sh_name = offset;
+		memcpy(buf + offset, sec->name, len);
+		offset += len;
+	}
+
+	if (offset != size)
+		ERROR("shstrtab size mismatch");
+
+	shstrtab->data->d_buf = buf;
+	shstrtab->data->d_size = size;
+
+	if (loglevel <= DEBUG) {
+		log_debug("shstrtab: ");
+		print_strtab(buf, size);
+		log_debug("\n");
+
+		for_each_section(i, sec, &kelf->sections)
+			log_debug("%s @ shstrtab offset %d\n",
+				  sec->name, sec->sh.sh_name);
+	}
+}
+
+void kpatch_create_strtab(struct kpatch_elf *kelf)
+{
+	struct section *strtab;
+	struct symbol *sym;
+	size_t size, offset, len;
+	int i;
+	char *buf;
+
+	strtab = find_section_by_name(&kelf->sections, ".strtab");
+	if (!strtab)
+		ERROR("find_section_by_name");
+
+	/* determine size of string table */
+	size = 1; /* for initial NULL terminator */
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0 || sym->type == STT_SECTION)
+			continue;
+		size += strlen(sym->name) + 1; /* include NULL terminator */
+	}
+
+	/* allocate data buffer */
+	buf = kpatch_alloc(size);
+	memset(buf, 0, size);
+
+	/* populate string table and link with section header */
+	offset = 1;
+	for_each_symbol(i, sym, &kelf->symbols) {
+		if (i == 0)
+			continue;
+		if (sym->type == STT_SECTION) {
+			sym->sym.st_name = 0;
+			continue;
+		}
+		len = strlen(sym->name) + 1;
+		sym->sym.st_name = offset;
+		memcpy(buf + offset, sym->name, len);
+		offset += len;
+	}
+
+	if (offset != size)
+		ERROR("shstrtab size mismatch");
+
+	strtab->data->d_buf = buf;
+	strtab->data->d_size = size;
+
+	if (loglevel <= DEBUG) {
+		log_debug("strtab: ");
+		print_strtab(buf, size);
+		log_debug("\n");
+
+		for_each_symbol(i, sym, &kelf->symbols)
+			log_debug("%s @ strtab offset %d\n",
+				  sym->name, sym->sym.st_name);
+	}
+}
+
+void kpatch_create_symtab(struct kpatch_elf *kelf)
+{
+	struct section *symtab, *shndx = NULL, *sec;
+	struct symbol *sym;
+	Elf32_Word *xndx = NULL;
+	char *buf;
+	size_t size;
+	int i;
+
+	symtab = find_section_by_name(&kelf->sections, ".symtab");
+	if (!symtab)
+		ERROR("find_section_by_name");
+
+	for_each_section(i, sec, &kelf->sections)
+		if (sec->sh.sh_type == SHT_SYMTAB_SHNDX)
+			shndx = sec;
+
+	/* create new symtab buffer */
+	size = kelf->symbols.nr * symtab->sh.sh_entsize;
+	buf = kpatch_alloc(size);
+	memset(buf, 0, size);
+
+	if (shndx) {
+		xndx = kpatch_alloc(kelf->symbols.nr * sizeof(*xndx));
+		memset(xndx, 0, kelf->symbols.nr * sizeof(*xndx));
+	}
+
+	for_each_symbol(i, sym, &kelf->symbols) {
+		memcpy(buf + (i * symtab->sh.sh_entsize), &sym->sym,
+		       symtab->sh.sh_entsize);
+
+		if (sym->sym.st_shndx != SHN_XINDEX)
+			continue;
+		if (!xndx || !sym->sec || !sym->sec->twino)
+			ERROR("can't find extended section index for symbol %s",
+			      sym->name);
+		xndx[i] = sym->sec->twino->index;
+	}
+
+	symtab->data->d_buf = buf;
+	symtab->data->d_size = size;
+
+	if (shndx) {
+		shndx->data->d_buf = xndx;
+		shndx->data->d_size = kelf->symbols.nr * sizeof(*xndx);
+		shndx->sh.sh_size = shndx->data->d_size;
+		shndx->sh.sh_link = symtab->index;
+	}
+
+	symtab->sh.sh_link =
+		find_section_by_name(&kelf->sections, ".strtab")->index;
+
+	/* the local symbols come first, sh_info is one past the last one */
+	for_each_symbol(i, sym, &kelf->symbols)
+		if (sym->bind != STB_LOCAL)
+			break;
+	symtab->sh.sh_info = i;
+}
+
+/*
+ * libelf can only write ELF files to a file descriptor, so the output is
+ * written to an anonymous memory file and read back into a buffer for the
+ * caller.
+ */
+void kpatch_write_output_elf(struct kpatch_elf *kelf, Elf *elf,
+			     struct kpatch_diff_result *result)
+{
+	int i;
+	struct section *sec;
+	Elf *elfout;
+	GElf_Ehdr eh, ehout;
+	Elf_Scn *scn;
+	Elf_Data *data;
+	GElf_Shdr sh;
+	size_t shstrndx, offset, align;
+	off_t size;
+	ssize_t ret;
+
+	state->fd = memfd_create("kpatch-diff", 0);
+	if (state->fd == -1)
+		ERROR("memfd_create");
+
+	elfout = elf_begin(state->fd, ELF_C_WRITE, NULL);
+	if (!elfout)
+		ERROR("elf_begin");
+	state->elfs[state->elfs_nr++] = elfout;
+
+	if (!gelf_newehdr(elfout, gelf_getclass(kelf->elf)))
+		ERROR("gelf_newehdr");
+
+	if (!gelf_getehdr(elfout, &ehout))
+		ERROR("gelf_getehdr");
+
+	if (!gelf_getehdr(elf, &eh))
+		ERROR("gelf_getehdr");
+
+	memset(&ehout, 0, sizeof(ehout));
+	ehout.e_ident[EI_DATA] = eh.e_ident[EI_DATA];
+	ehout.e_machine = eh.e_machine;
+	ehout.e_type = eh.e_type;
+	ehout.e_version = EV_CURRENT;
+	shstrndx = find_section_by_name(&kelf->sections, ".shstrtab")->index;
+	ehout.e_shstrndx = shstrndx;
+
+	/*
+	 * Lay out the file here instead of leaving it to libelf, so the output
+	 * only depends on the sections themselves: each section follows the
+	 * previous one at its alignment, the gaps are zero filled, and the
+	 * section header table comes last.
+	 */
+	offset = gelf_fsize(elfout, ELF_T_EHDR, 1, EV_CURRENT);
+
+	/* add changed sections */
+	for_each_section(i, sec, &kelf->sections) {
+		scn = elf_newscn(elfout);
+		if (!scn)
+			ERROR("elf_newscn");
+
+		data = elf_newdata(scn);
+		if (!data)
+			ERROR("elf_newdata");
+
+		*data = *sec->data;
+
+		if(!gelf_getshdr(scn, &sh))
+			ERROR("gelf_getshdr");
+
+		sh = sec->sh;
+
+		/* the regenerated sections only have their data size updated */
+		if (sh.sh_type != SHT_NOBITS)
+			sh.sh_size = sec->data->d_size;
+
+		align = sh.sh_addralign ? sh.sh_addralign : 1;
+		offset = (offset + align - 1) & ~(align - 1);
+		sh.sh_offset = offset;
+		if (sh.sh_type != SHT_NOBITS)
+			offset += sh.sh_size;
+		data->d_off = 0;
+		data->d_align = align;
+
+		if (!elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY))
+			ERROR("elf_flagdata");
+
+		if (!gelf_update_shdr(scn, &sh))
+			ERROR("gelf_update_shdr");	
+	}
+
+	/*
+	 * If the section header string table index doesn't fit in the ELF
+	 * header, it's stored in the link field of section 0.
+	 */
+	if (shstrndx >= SHN_LORESERVE) {
+		ehout.e_shstrndx = SHN_XINDEX;
+
+		scn = elf_getscn(elfout, 0);
+		if (!scn)
+			ERROR("elf_getscn");
+
+		if (!gelf_getshdr(scn, &sh))
+			ERROR("gelf_getshdr");
+
+		sh.sh_link = shstrndx;
+
+		if (!gelf_update_shdr(scn, &sh))
+			ERROR("gelf_update_shdr");
+	}
+
+	align = gelf_getclass(elfout) == ELFCLASS64 ? 8 : 4;
+	ehout.e_shoff = (offset + align - 1) & ~(align - 1);
+
+	if (!gelf_update_ehdr(elfout, &ehout))
+		ERROR("gelf_update_ehdr");
+
+	if (!elf_flagelf(elfout, ELF_C_SET, ELF_F_LAYOUT))
+		ERROR("elf_flagelf");
+
+	if (elf_update(elfout, ELF_C_WRITE) < 0)
+		ERROR("elf_update: %s", elf_errmsg(-1));
+
+	size = lseek(state->fd, 0, SEEK_END);
+	if (size == -1)
+		ERROR("lseek");
+
+	result->output = malloc(size);
+	if (!result->output)
+		ERROR("malloc");
+	result->output_size = size;
+
+	for (offset = 0; offset < size; offset += ret) {
+		ret = pread(state->fd, result->output + offset, size - offset,
+			    offset);
+		if (ret <= 0)
+			ERROR("pread");
+	}
+}
+
+void kpatch_diff_init(struct kpatch_diff_state *diff_state,
+		      const struct kpatch_diff_options *options,
+		      struct kpatch_diff_result *result)
+{
+	memset(result, 0, sizeof(*result));
+	memset(diff_state, 0, sizeof(*diff_state));
+	diff_state->result = result;
+	diff_state->fd = -1;
+	state = diff_state;
+
+	logfile = options->log;
+	loglevel = !logfile ? QUIET : options->debug ? DEBUG : NORMAL;
+	profile = NULL;
+	profile_nr = 0;
+	profile_total = 0;
+
+	elf_version(EV_CURRENT);
+}
+
+int kpatch_diff(void *orig, size_t orig_size, void *patched,
+		size_t patched_size, const struct kpatch_diff_options *options,
+		struct kpatch_diff_result *result)
+{
+	struct kpatch_diff_state diff_state;
+	struct kpatch_elf *kelf_base, *kelf_patched, *kelf_out;
+	struct fingerprint_db db;
+	int status;
+
+	kpatch_diff_init(&diff_state, options, result);
+
+	status = setjmp(diff_state.env);
+	if (status) {
+		kpatch_diff_cleanup();
+		kpatch_diff_free(result);
+		return status;
+	}
+
+	if (options->profile)
+		kpatch_read_profile(options->profile, options->profile_size);
+
+	if (options->base_fingerprint) {
+		kelf_patched = kpatch_elf_open(patched, patched_size);
+		kpatch_check_program_headers(kelf_patched->elf);
+
+		kpatch_read_fingerprints(options->base_fingerprint,
+					 options->base_fingerprint_size, &db);
+		kpatch_compare_fingerprints(kelf_patched, &db);
+	} else {
+		kelf_base = kpatch_elf_open(orig, orig_size);
+		kelf_patched = kpatch_elf_open(patched, patched_size);
+
+		kpatch_compare_elf_headers(kelf_base->elf, kelf_patched->elf);
+		kpatch_check_program_headers(kelf_base->elf);
+		kpatch_check_program_headers(kelf_patched->elf);
+
+		kpatch_correlate_elfs(kelf_base, kelf_patched);
+		/*
+		 * After this point, we don't care about kelf_base anymore.
+		 * We access its sections via the twin pointers in the
+		 * section, symbol, and rela lists of kelf_patched.
+		 */
+		kpatch_compare_correlated_elements(kelf_patched);
+	}
+
+	/*
+	 * Mangle the relas a little.  The compiler will sometimes
+	 * use section symbols to reference local objects and functions
+	 * rather than the object or function symbols themselves.
+	 * We substitute the object/function symbols for the section
+	 * symbol in this case so that the existing object/function
+	 * in vmlinux can be linked to.
+	 */
+	kpatch_replace_sections_syms(kelf_patched);
+
+	kpatch_include_changed_functions(kelf_patched);
+	kpatch_process_special_sections(kelf_patched);
+	kpatch_dump_kelf(kelf_patched);
+
+	if (options->report) {
+		state->report = open_memstream(&result->report,
+					       &result->report_size);
+		if (!state->report)
+			ERROR("open_memstream");
+		kpatch_write_report(kelf_patched, state->report);
+		fclose(state->report);
+		state->report = NULL;
+	}
+
+	/* Generate the output elf */
+	kpatch_generate_output(kelf_patched, &kelf_out);
+	kpatch_compact_string_sections(kelf_out);
+	kpatch_create_rela_sections(kelf_out);
+	kpatch_create_shstrtab(kelf_out);
+	kpatch_create_strtab(kelf_out);
+	kpatch_create_symtab(kelf_out);
+	kpatch_dump_kelf(kelf_out);
+
+	if (options->inventory) {
+		state->inventory = open_memstream(&result->inventory,
+						  &result->inventory_size);
+		if (!state->inventory)
+			ERROR("open_memstream");
+		kpatch_write_inventory(kelf_out, state->inventory);
+		fclose(state->inventory);
+		state->inventory = NULL;
+	}
+	kpatch_write_output_elf(kelf_out, kelf_patched->elf, result);
+
+	kpatch_diff_cleanup();
+	return KPATCH_DIFF_OK;
+}
+
+int kpatch_fingerprint(void *obj, size_t size,
+		       const struct kpatch_diff_options *options,
+		       struct kpatch_diff_result *result)
+{
+	struct kpatch_diff_state diff_state;
+	struct kpatch_elf *kelf;
+	int status;
+
+	kpatch_diff_init(&diff_state, options, result);
+
+	status = setjmp(diff_state.env);
+	if (status) {
+		kpatch_diff_cleanup();
+		kpatch_diff_free(result);
+		return status;
+	}
+
+	kelf = kpatch_elf_open(obj, size);
+	kpatch_check_program_headers(kelf->elf);
+
+	state->inventory = open_memstream((char **)&result->output,
+					  &result->output_size);
+	if (!state->inventory)
+		ERROR("open_memstream");
+	kpatch_write_fingerprints(kelf, state->inventory);
+	fclose(state->inventory);
+	state->inventory = NULL;
+
+	kpatch_diff_cleanup();
+	return KPATCH_DIFF_OK;
+}
+
+void kpatch_diff_free(struct kpatch_diff_result *result)
+{
+	free(result->output);
+	free(result->inventory);
+	free(result->report);
+	result->output = NULL;
+	result->inventory = NULL;
+	result->report = NULL;
+	result->output_size = 0;
+	result->inventory_size = 0;
+	result->report_size = 0;
+}
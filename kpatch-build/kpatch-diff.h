@@ -0,0 +1,87 @@
+/*
+ * kpatch-diff.h
+ *
+ * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
+ * Copyright (C) 2013 Josh Poimboeuf <jpoimboe@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ *
+ * Interface to the ELF object differencing engine, for create-diff-object
+ * and for programs which keep objects in memory.
+ */
+
+#ifndef _KPATCH_DIFF_H_
+#define _KPATCH_DIFF_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+enum kpatch_diff_status {
+	KPATCH_DIFF_OK,
+	KPATCH_DIFF_ERROR,	/* bad input or internal error */
+	KPATCH_DIFF_FATAL,	/* the objects differ in a way which can't be patched */
+};
+
+struct kpatch_diff_options {
+	FILE *log;		/* progress and debug output, or NULL */
+	int debug;
+	int inventory;		/* list the output sections and symbols */
+	int report;		/* describe the changed functions */
+	const char *profile;	/* lines of "<count> <symbol>", or NULL */
+	size_t profile_size;
+	const char *base_fingerprint;	/* from kpatch_fingerprint(), or NULL */
+	size_t base_fingerprint_size;
+};
+
+struct kpatch_diff_result {
+	void *output;		/* the output object */
+	size_t output_size;
+	char *inventory;
+	size_t inventory_size;
+	char *report;
+	size_t report_size;
+	char error[256];	/* the reason a diff failed */
+};
+
+/*
+ * Diff the original and patched object images and create the output object
+ * in result.  The images are used in place and libelf may convert them to
+ * the host's byte order, so they must be writable.
+ *
+ * Returns KPATCH_DIFF_OK, or the reason for failure with a message in
+ * result->error.  On success, the result buffers belong to the caller and
+ * are freed with kpatch_diff_free().  The engine keeps no state between
+ * calls, and calls from separate threads can run at the same time.
+ */
+int kpatch_diff(void *orig, size_t orig_size, void *patched,
+		size_t patched_size, const struct kpatch_diff_options *options,
+		struct kpatch_diff_result *result);
+
+/*
+ * Fingerprint the sections and symbols of a base object, for diffing a
+ * patched object against it later without the base object itself.  The
+ * fingerprint database is text, and is returned in result->output.
+ *
+ * When options->base_fingerprint is set, kpatch_diff() compares the patched
+ * object against the fingerprint database and ignores orig.
+ */
+int kpatch_fingerprint(void *obj, size_t size,
+		       const struct kpatch_diff_options *options,
+		       struct kpatch_diff_result *result);
+
+void kpatch_diff_free(struct kpatch_diff_result *result);
+
+#endif /* _KPATCH_DIFF_H_ */
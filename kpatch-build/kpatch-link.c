@@ -1,5 +1,5 @@
 /*
- * add-patches-section.c
+ * kpatch-link.c
  *
  * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
  *
@@ -21,9 +21,10 @@
 
 /*
  * This tool takes an elf object, the output of create-diff-object
- * and the base vmlinux as arguments and adds two new sections
- * to the elf object; .patches and .rela.patches.
+ * and the base vmlinux as arguments and links the object against the
+ * vmlinux, in a single pass over its symbols and a single ELF update.
  *
+ * It adds two new sections to the elf object; .patches and .rela.patches.
  * These two sections allow the kpatch core modules to know which
  * functions are overridden by the patch module.
  *
@@ -31,6 +32,16 @@
  * module will register as an ftrace handler for the old function.  The new
  * function will return to the caller of the old function, not the old function
  * itself, bypassing the old function.
+ *
+ * It also hardcodes the addresses of any global symbols that are referenced
+ * by the object but are not exported by vmlinux into its symbol table, as
+ * absolute symbols.  They stay global so the object can still be linked
+ * into the patch module.  Global symbols that are exported by the base
+ * vmlinux can be resolved by the kernel module linker at load time and are
+ * left unmodified.
+ *
+ * Instead of the vmlinux, the tool can be given its symbol index, as
+ * created by create-symbol-index.
  */
 
 #include <sys/types.h>
@@ -44,6 +55,7 @@
 #include <unistd.h>
 
 #include "kpatch-patch.h"
+#include "symindex.h"
 
 #define ERROR(format, ...) \
 	error(1, 0, "%s: %d: " format, __FUNCTION__, __LINE__, ##__VA_ARGS__)
@@ -60,17 +72,18 @@ enum symaction {
 };
 
 struct sym {
-	struct sym *next;
 	GElf_Sym sym;
 	char *name;
 	int index;
 	enum symaction action;
 	unsigned long vm_addr;
 	size_t vm_len;
+	unsigned long vm_cold_addr;
+	size_t vm_cold_len;
 };
 
 struct symlist {
-	struct sym *head, *tail;
+	struct sym *syms;
 	size_t len;
 };
 
@@ -82,7 +95,7 @@ struct elf {
 };
 
 #define for_each_sym(list, iter) \
-	for((iter) = (list)->head; (iter); (iter) = (iter)->next)
+	for((iter) = (list)->syms; (iter) < (list)->syms + (list)->len; (iter)++)
 
 enum elfmode {
 	RDONLY,
@@ -121,21 +134,11 @@ static void open_elf(char *path, enum elfmode elfmode, struct elf *elf)
 static void insert_sym(struct symlist *list, GElf_Sym *sym, char *name,
                        int index)
 {
-	struct sym *newsym;
+	struct sym *newsym = &list->syms[index];
 
-	newsym = malloc(sizeof(*newsym));
-	if (!newsym)
-		ERROR("malloc");
-	memset(newsym, 0, sizeof(*newsym));
 	newsym->sym = *sym;
 	newsym->name = name;
 	newsym->index = index;
-
-	if (list->tail)
-		list->tail->next = newsym;
-	if (!list->head)
-		list->head = newsym;
-	list->tail = newsym;
 }
 
 static void find_section_by_name(struct elf *elf, char *name, struct section *sec)
@@ -178,6 +181,10 @@ static void create_symlist(struct elf *elf, struct symlist *symlist)
 		ERROR("elf_getdata");
 
 	symlist->len = sh->sh_size / sh->sh_entsize;
+	symlist->syms = calloc(symlist->len, sizeof(*symlist->syms));
+	if (!symlist->syms)
+		ERROR("calloc");
+
 	for (i = 0; i < symlist->len; i++) {
 		if (!gelf_getsym(data, i, &sym))
 			ERROR("gelf_getsym");
@@ -190,60 +197,98 @@ static void create_symlist(struct elf *elf, struct symlist *symlist)
 	}
 }
 
-static struct sym *find_symbol_by_name(struct symlist *list, struct sym *sym,
-                                       char *hint)
+static struct symindex_sym *find_symbol_by_name(struct symindex *index,
+                                                struct sym *sym, char *hint)
 {
-	struct sym *cur, *ret = NULL;
-	char *name = sym->name, *curfile = NULL;
+	struct symindex_sym *cur;
+	char *name = sym->name;
 
-	/* try to find a local symbol in the hint file first */
+	/*
+	 * Try to find a local symbol in the hint file first, then among the
+	 * symbols of no file, which is where a System.map puts them.
+	 */
 	if (hint && GELF_ST_BIND(sym->sym.st_info) == STB_LOCAL) {
-		for_each_sym(list, cur) {
-			if (GELF_ST_TYPE(cur->sym.st_info) == STT_FILE)
-				curfile = cur->name;
-			if (!curfile || strcmp(curfile, hint))
-				continue;
-			if (!strcmp(cur->name, name)) {
-				if (ret)
-					ERROR("unresolvable symbol ambiguity for symbol '%s' in file '%s'", name, hint);
-				ret = cur;
-			}
+		cur = symindex_find_local(index, hint, name, NULL);
+		if (!cur) {
+			hint = "";
+			cur = symindex_find_local(index, hint, name, NULL);
 		}
+		if (cur && symindex_find_local(index, hint, name, cur))
+			ERROR("unresolvable symbol ambiguity for symbol '%s' in file '%s'", name, hint);
+		if (cur)
+			return cur;
 	}
 
-	if (ret)
-		return ret;
-
 	/* search globally for the symbol */
-	for_each_sym(list, cur)
-		if (GELF_ST_BIND(sym->sym.st_info) == STB_GLOBAL &&
-		    !strcmp(cur->name, name))
+	if (GELF_ST_BIND(sym->sym.st_info) != STB_GLOBAL)
+		return NULL;
+	for (cur = symindex_find(index, name, NULL); cur;
+	     cur = symindex_find(index, name, cur))
+		if (GELF_ST_BIND(cur->info) != STB_LOCAL)
 			return cur;
 
 	return NULL;
 }
 
-/*
- * TODO: de-dup common code above these point with code
- * in link-vmlinux-syms.c
- */
+/* find the cold part of a function in the hint file, or of no file */
+static struct symindex_sym *find_cold_symbol(struct symindex *index,
+                                             char *name, char *hint)
+{
+	struct symindex_sym *cold;
+
+	if (!hint)
+		return NULL;
+
+	cold = symindex_find_cold(index, hint, name, NULL);
+	if (!cold)
+		cold = symindex_find_cold(index, "", name, NULL);
+
+	return cold;
+}
+
+/* find a non-exported symbol, which must be unique */
+static struct symindex_sym *find_link_symbol(struct symindex *index,
+                                             char *name)
+{
+	struct symindex_sym *sym;
+
+	sym = symindex_find(index, name, NULL);
+	if (sym && symindex_find(index, name, sym))
+		ERROR("unresolvable symbol ambiguity for symbol '%s'", name);
+
+	return sym;
+}
+
+/* check the __kstrtab_ entries of all the symbols of that name */
+static int is_exported(struct symindex *index, char *name)
+{
+	struct symindex_sym *sym;
+
+	for (sym = symindex_find(index, name, NULL); sym;
+	     sym = symindex_find(index, name, sym))
+		if (sym->flags & SYMINDEX_EXPORTED)
+			return 1;
+
+	return 0;
+}
 
 int main(int argc, char **argv)
 {
-	struct symlist symlist, symlistv;
-	struct sym *cur, *vsym;
-	struct elf elf, elfv;
+	struct symlist symlist;
+	struct symindex index;
+	struct symindex_sym *vsym, *cold;
+	struct sym *cur;
+	struct elf elf;
 	void *buf;
 	struct kpatch_patch *patches_data;
 	GElf_Rela *relas_data;
 	int patches_nr = 0, i, patches_size, relas_size, len;
-	int patches_offset, relas_offset, patches_index, relas_index;
+	int patches_offset, relas_offset, patches_index;
 	struct section symtab;
 	Elf_Scn *scn;
 	Elf_Data *data;
 	GElf_Shdr sh, *shp;
-	GElf_Ehdr eh;
-	GElf_Sym sym;
+	size_t shnum;
 	char *hint = NULL;
 
 	/* set elf version (required by libelf) */
@@ -251,43 +296,77 @@ int main(int argc, char **argv)
 		ERROR("elf_version");
 
 	memset(&elf, 0, sizeof(elf));
-	memset(&elfv, 0, sizeof(elfv));
 	open_elf(argv[1], RDWR, &elf);
-	open_elf(argv[2], RDONLY, &elfv);
+	symindex_open(argv[2], &index);
 
 	find_section_by_name(&elf, ".symtab", &(elf.symtab));
-	find_section_by_name(&elfv, ".symtab", &(elfv.symtab));
 
 	find_section_by_name(&elf, ".shstrtab", &(elf.shstrtab));
 
 	memset(&symlist, 0, sizeof(symlist));
-	memset(&symlistv, 0, sizeof(symlistv));
 	create_symlist(&elf, &symlist);
-	create_symlist(&elfv, &symlistv);
 
-	/* lookup patched functions in vmlinux */
+	/*
+	 * lookup patched functions and non-exported globals in vmlinux
+	 */
 	for_each_sym(&symlist, cur) {
 		if (GELF_ST_TYPE(cur->sym.st_info) == STT_FILE)
 			hint = cur->name;
 
+		if (GELF_ST_TYPE(cur->sym.st_info) == STT_NOTYPE &&
+		    GELF_ST_BIND(cur->sym.st_info) == STB_GLOBAL &&
+		    cur->sym.st_shndx == STN_UNDEF &&
+		    strcmp(cur->name, "kpatch_register") &&
+		    strcmp(cur->name, "kpatch_unregister")) {
+			printf("found global symbol %s\n", cur->name);
+			if (is_exported(&index, cur->name)) {
+				printf("symbol is exported by the kernel\n");
+				continue;
+			}
+
+			vsym = find_link_symbol(&index, cur->name);
+			if (!vsym)
+				ERROR("couldn't find global function %s in vmlinux",
+				      cur->name);
+
+			cur->vm_addr = vsym->addr;
+			cur->vm_len = vsym->size;
+			cur->action = LINK;
+			printf("original symbol at address %016lx (length %zu)\n",
+			       cur->vm_addr, cur->vm_len);
+			continue;
+		}
+
 		if (GELF_ST_TYPE(cur->sym.st_info) != STT_FUNC)
 			continue;
 
+		/* cold parts are replaced along with their parent function */
+		if (cold_parent_len(cur->name))
+			continue;
+
 		printf("found patched function %s\n", cur->name);
 
-		vsym = find_symbol_by_name(&symlistv, cur, hint);
+		vsym = find_symbol_by_name(&index, cur, hint);
 		if (!vsym)
 			ERROR("couldn't find patched function in vmlinux");
-		cur->vm_addr = vsym->sym.st_value;
-		cur->vm_len = vsym->sym.st_size;
+		cur->vm_addr = vsym->addr;
+		cur->vm_len = vsym->size;
 		cur->action = PATCH;
 		printf("original function at address %016lx (length %zu)\n",
 		       cur->vm_addr, cur->vm_len);
+
+		cold = find_cold_symbol(&index, cur->name, hint);
+		if (cold) {
+			cur->vm_cold_addr = cold->addr;
+			cur->vm_cold_len = cold->size;
+			printf("original cold part %s at address %016lx (length %zu)\n",
+			       symindex_name(&index, cold), cur->vm_cold_addr,
+			       cur->vm_cold_len);
+		}
 		patches_nr++;
 	}
 
-	elf_end(elfv.elf);
-	close(elfv.fd);
+	symindex_close(&index);
 
 	if (!patches_nr)
 		ERROR("no patched functions");
@@ -317,16 +396,20 @@ int main(int argc, char **argv)
 			continue;
 		patches_data[i].old_addr = cur->vm_addr;
 		patches_data[i].old_size = cur->vm_len;
+		patches_data[i].old_cold_addr = cur->vm_cold_addr;
+		patches_data[i].old_cold_size = cur->vm_cold_len;
 		relas_data[i].r_offset = i * sizeof(struct kpatch_patch);
 		relas_data[i].r_info = GELF_R_INFO(cur->index, R_X86_64_64);
 		i++;
 	}
 
-	/* get next section index from elf header */
-	if (!gelf_getehdr(elf.elf, &eh))
-		ERROR("gelf_getehdr");
-	patches_index = eh.e_shnum;
-	relas_index = patches_index  + 1;
+	/*
+	 * Get next section index.  e_shnum in the ELF header is zero for
+	 * objects with extended section numbering, so ask libelf instead.
+	 */
+	if (elf_getshdrnum(elf.elf, &shnum))
+		ERROR("elf_getshdrnum");
+	patches_index = shnum;
 
 	/* add new section names to shstrtab */
 	scn = elf.shstrtab.scn;
@@ -370,25 +453,16 @@ int main(int argc, char **argv)
 	if (!data)
 		ERROR("elf_getdata");
 
-	/* add new section symbols to symtab */
-	len = sizeof(GElf_Sym) * 2;
-	buf = malloc(data->d_size + len);
-	memcpy(buf, data->d_buf, data->d_size);
-
-	data->d_buf = buf;
-	buf = data->d_buf + data->d_size;
-
-	memset(&sym, 0, sizeof(GElf_Sym));
-	sym.st_info = GELF_ST_INFO(STB_LOCAL, STT_SECTION);
-
-	len = sizeof(GElf_Sym);
-	sym.st_shndx = patches_index;
-	memcpy(buf, &sym, len);
-	buf += len;
-	sym.st_shndx = relas_index;
-	memcpy(buf, &sym, len);
-	buf += len;
-	data->d_size = buf - data->d_buf;
+	/* update LINK symbols */
+	for_each_sym(&symlist, cur) {
+		if (cur->action != LINK)
+			continue;
+		cur->sym.st_value = cur->vm_addr;
+		cur->sym.st_info = GELF_ST_INFO(STB_GLOBAL, STT_FUNC);
+		cur->sym.st_shndx = SHN_ABS;
+		if (!gelf_update_sym(data, cur->index, &cur->sym))
+			ERROR("gelf_update_sym");
+	}
 
 	if (!elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY))
 		ERROR("elf_flagdata");
@@ -0,0 +1,669 @@
+/*
+ * symindex.c
+ *
+ * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ */
+
+/*
+ * The symbol index holds the symbol table of a vmlinux in a form which can
+ * be mapped and searched without parsing the ELF file: the names,
+ * addresses, sizes and binding of the symbols, the file each local symbol
+ * belongs to, and whether it's exported.  It's built once per kernel build
+ * by create-symbol-index, or on the fly when a tool is given the vmlinux
+ * itself.
+ *
+ * The index can also be built from a symbol listing in place of the
+ * vmlinux: a System.map, /proc/kallsyms, or the output of "nm -a -p -S",
+ * which adds the sizes and the source file symbols in symbol table order.
+ * Symbols listed before any source file, which is all of them in a
+ * System.map, belong to the file "".
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <error.h>
+#include <gelf.h>
+#include <unistd.h>
+
+#include "symindex.h"
+
+#define ERROR(format, ...) \
+	error(1, 0, "%s: %d: " format, __FUNCTION__, __LINE__, ##__VA_ARGS__)
+
+#define KSTRTAB_PREFIX "__kstrtab_"
+
+size_t cold_parent_len(const char *name)
+{
+	const char *cold, *p;
+
+	cold = strstr(name, ".cold");
+	if (!cold || cold == name)
+		return 0;
+
+	p = cold + 5;
+	if (*p == '.' && p[1]) {
+		while (*++p >= '0' && *p <= '9')
+			;
+	}
+	if (*p)
+		return 0;
+
+	return cold - name;
+}
+
+/* FNV-1a, over at most the first len bytes of str */
+static uint32_t hash_str(uint32_t hash, const char *str, size_t len)
+{
+	while (len-- && *str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static uint32_t sym_hash(const char *file, const char *name, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	if (file)
+		hash = hash_str(hash, file, -1);
+	return hash_str(hash, name, len);
+}
+
+static size_t symindex_size(uint32_t syms_nr, uint32_t hash_size,
+			    uint32_t strings_size)
+{
+	return sizeof(struct symindex_header) +
+	       syms_nr * sizeof(struct symindex_sym) +
+	       3 * sizeof(uint32_t) * hash_size + strings_size;
+}
+
+/* point the index at the parts of its buffer */
+static void symindex_layout(struct symindex *index)
+{
+	struct symindex_header *header = index->buf;
+
+	index->header = header;
+	index->syms = (struct symindex_sym *)(header + 1);
+	index->names = (uint32_t *)(index->syms + header->syms_nr);
+	index->locals = index->names + header->hash_size;
+	index->colds = index->locals + header->hash_size;
+	index->strings = (char *)(index->colds + header->hash_size);
+}
+
+static void insert_chain(uint32_t *bucket, uint32_t *next, uint32_t i)
+{
+	*next = *bucket;
+	*bucket = i + 1;
+}
+
+/* allocate an index, leaving the symbols and strings to be filled in */
+static void symindex_alloc(struct symindex *index, uint32_t syms_nr,
+			   uint32_t strings_size)
+{
+	struct symindex_header *header;
+	uint32_t hash_size;
+
+	/* keep the load factor at or below 1/2 */
+	for (hash_size = 1; hash_size < syms_nr * 2; hash_size <<= 1)
+		;
+
+	index->size = symindex_size(syms_nr, hash_size, strings_size);
+	index->buf = calloc(1, index->size);
+	if (!index->buf)
+		ERROR("calloc");
+	index->mapped = 0;
+
+	header = index->buf;
+	memcpy(header->magic, SYMINDEX_MAGIC, sizeof(header->magic));
+	header->version = SYMINDEX_VERSION;
+	header->syms_nr = syms_nr;
+	header->hash_size = hash_size;
+	header->strings_size = strings_size;
+	symindex_layout(index);
+}
+
+/* chain the symbols into the hash tables and flag the exported ones */
+static void symindex_hash(struct symindex *index)
+{
+	struct symindex_sym *sym, *exported;
+	uint32_t syms_nr = index->header->syms_nr;
+	uint32_t mask = index->header->hash_size - 1;
+	uint32_t i;
+	size_t len;
+	char *name, *file;
+
+	/*
+	 * Go backwards so the chains are in symbol table order, and the first
+	 * symbol of a given name is found first.  Symbol 0 is the null symbol.
+	 */
+	for (i = syms_nr - 1; i > 0 && i < syms_nr; i--) {
+		sym = &index->syms[i];
+		name = symindex_name(index, sym);
+		file = index->strings + sym->file;
+
+		insert_chain(&index->names[sym_hash(NULL, name, -1) & mask],
+			     &sym->name_next, i);
+
+		if (GELF_ST_BIND(sym->info) == STB_LOCAL)
+			insert_chain(&index->locals[sym_hash(file, name, -1) &
+						    mask],
+				     &sym->local_next, i);
+
+		len = cold_parent_len(name);
+		if (len && GELF_ST_TYPE(sym->info) == STT_FUNC)
+			insert_chain(&index->colds[sym_hash(file, name, len) &
+						   mask],
+				     &sym->cold_next, i);
+	}
+
+	for (i = 1; i < syms_nr; i++) {
+		name = symindex_name(index, &index->syms[i]);
+		if (strncmp(name, KSTRTAB_PREFIX, strlen(KSTRTAB_PREFIX)))
+			continue;
+		name += strlen(KSTRTAB_PREFIX);
+		for (exported = symindex_find(index, name, NULL); exported;
+		     exported = symindex_find(index, name, exported))
+			exported->flags |= SYMINDEX_EXPORTED;
+	}
+}
+
+static void symindex_build(Elf *elf, struct symindex *index)
+{
+	struct symindex_sym *sym;
+	Elf_Scn *scn = NULL;
+	Elf_Data *data;
+	GElf_Shdr sh;
+	GElf_Sym gsym;
+	uint32_t syms_nr, strings_size, i;
+	size_t len;
+	char *name, *strings;
+
+	while ((scn = elf_nextscn(elf, scn))) {
+		if (!gelf_getshdr(scn, &sh))
+			ERROR("gelf_getshdr");
+		if (sh.sh_type == SHT_SYMTAB)
+			break;
+	}
+	if (!scn)
+		ERROR("no symbol table found");
+
+	data = elf_getdata(scn, NULL);
+	if (!data)
+		ERROR("elf_getdata");
+
+	/* the string table starts with an empty string for "no file" */
+	syms_nr = sh.sh_size / sh.sh_entsize;
+	strings_size = 1;
+	for (i = 0; i < syms_nr; i++) {
+		if (!gelf_getsym(data, i, &gsym))
+			ERROR("gelf_getsym");
+		name = elf_strptr(elf, sh.sh_link, gsym.st_name);
+		if (!name)
+			ERROR("elf_strptr sym");
+		strings_size += strlen(name) + 1;
+	}
+
+	symindex_alloc(index, syms_nr, strings_size);
+
+	strings = index->strings + 1;
+	for (i = 0; i < syms_nr; i++) {
+		sym = &index->syms[i];
+		gelf_getsym(data, i, &gsym);
+		name = elf_strptr(elf, sh.sh_link, gsym.st_name);
+
+		sym->addr = gsym.st_value;
+		sym->size = gsym.st_size;
+		sym->info = gsym.st_info;
+		sym->name = strings - index->strings;
+		len = strlen(name) + 1;
+		memcpy(strings, name, len);
+		strings += len;
+
+		if (GELF_ST_TYPE(gsym.st_info) == STT_FILE)
+			sym->file = sym->name;
+		else if (i)
+			sym->file = index->syms[i - 1].file;
+	}
+
+	symindex_hash(index);
+}
+
+struct map_sym {
+	uint64_t addr;
+	uint64_t size;
+	char *name;
+	unsigned char info;
+};
+
+/* convert an nm symbol type letter to symbol table info */
+static unsigned char map_sym_info(char type)
+{
+	unsigned char bind, stype;
+
+	if (type == 'w' || type == 'W' || type == 'v' || type == 'V')
+		bind = STB_WEAK;
+	else if (type >= 'A' && type <= 'Z')
+		bind = STB_GLOBAL;
+	else
+		bind = STB_LOCAL;
+
+	switch (type | 0x20) {
+	case 't':
+	case 'w':
+		stype = STT_FUNC;
+		break;
+	case 'b':
+	case 'd':
+	case 'g':
+	case 'r':
+	case 's':
+	case 'v':
+		stype = STT_OBJECT;
+		break;
+	default:
+		stype = STT_NOTYPE;
+		break;
+	}
+
+	return GELF_ST_INFO(bind, stype);
+}
+
+/*
+ * Parse a line of "address [size] type name [module]".  Returns 0 for
+ * lines which don't describe a vmlinux symbol, which are skipped.
+ */
+static int parse_map_line(char *line, struct map_sym *msym, int *sized)
+{
+	char *fields[5], *save, *end;
+	int nr = 0, i = 0;
+	char type;
+
+	while (nr < 5 &&
+	       (fields[nr] = strtok_r(nr ? NULL : line, " \t\r", &save)))
+		nr++;
+
+	if (nr < 2)
+		return 0;
+
+	msym->addr = strtoull(fields[i++], &end, 16);
+	if (*end)
+		return 0;
+
+	*sized = nr >= 4 && strlen(fields[1]) > 1;
+	if (*sized) {
+		msym->size = strtoull(fields[i++], &end, 16);
+		if (*end)
+			return 0;
+	} else
+		msym->size = 0;
+
+	if (strlen(fields[i]) != 1)
+		return 0;
+	type = fields[i++][0];
+
+	/* nm prints the source file symbols as local absolute symbols */
+	if (type == 'a' && !msym->addr && !*sized) {
+		msym->name = i < nr ? fields[i] : "";
+		msym->info = GELF_ST_INFO(STB_LOCAL, STT_FILE);
+		return 1;
+	}
+
+	/* skip undefined symbols and the symbols of modules in kallsyms */
+	if (i >= nr || type == 'U' ||
+	    (i + 1 < nr && fields[i + 1][0] == '['))
+		return 0;
+
+	msym->name = fields[i];
+	msym->info = map_sym_info(type);
+	return 1;
+}
+
+static int cmp_addr(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Without sizes, assume each symbol extends up to the next address, as
+ * kallsyms does.
+ */
+static void estimate_sizes(struct map_sym *msyms, uint32_t nr)
+{
+	uint64_t *addrs;
+	uint32_t i, lo, hi, mid;
+
+	addrs = malloc(nr * sizeof(*addrs));
+	if (!addrs)
+		ERROR("malloc");
+	for (i = 0; i < nr; i++)
+		addrs[i] = msyms[i].addr;
+	qsort(addrs, nr, sizeof(*addrs), cmp_addr);
+
+	for (i = 0; i < nr; i++) {
+		if (GELF_ST_TYPE(msyms[i].info) == STT_FILE)
+			continue;
+		lo = 0;
+		hi = nr;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (addrs[mid] <= msyms[i].addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < nr)
+			msyms[i].size = addrs[lo] - msyms[i].addr;
+	}
+
+	free(addrs);
+}
+
+/* build the index of a System.map, kallsyms or nm symbol listing */
+static void symindex_build_map(char *buf, struct symindex *index)
+{
+	struct symindex_sym *sym;
+	struct map_sym *msyms = NULL;
+	uint32_t nr = 0, alloc = 0, strings_size = 1, i;
+	int sized, any_sized = 0;
+	char *line, *next, *strings;
+	size_t len;
+
+	for (line = buf; line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (nr == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			msyms = realloc(msyms, alloc * sizeof(*msyms));
+			if (!msyms)
+				ERROR("realloc");
+		}
+		if (!parse_map_line(line, &msyms[nr], &sized))
+			continue;
+		any_sized |= sized;
+		strings_size += strlen(msyms[nr].name) + 1;
+		nr++;
+	}
+	if (!nr)
+		ERROR("no symbols found");
+
+	/* /proc/kallsyms shows zeroes to those who may not see addresses */
+	for (i = 0; i < nr && !msyms[i].addr; i++)
+		;
+	if (i == nr)
+		ERROR("no symbol addresses found");
+
+	if (!any_sized)
+		estimate_sizes(msyms, nr);
+
+	/* symbol 0 is a null symbol, as in a symbol table */
+	symindex_alloc(index, nr + 1, strings_size);
+
+	strings = index->strings + 1;
+	for (i = 0; i < nr; i++) {
+		sym = &index->syms[i + 1];
+		sym->addr = msyms[i].addr;
+		sym->size = msyms[i].size;
+		sym->info = msyms[i].info;
+		sym->name = strings - index->strings;
+		len = strlen(msyms[i].name) + 1;
+		memcpy(strings, msyms[i].name, len);
+		strings += len;
+
+		if (GELF_ST_TYPE(sym->info) == STT_FILE)
+			sym->file = sym->name;
+		else
+			sym->file = index->syms[i].file;
+	}
+
+	free(msyms);
+	symindex_hash(index);
+}
+
+/*
+ * Read a whole file into a NUL-terminated buffer.  The size is only a
+ * hint: files in /proc like kallsyms report a size of zero, and pipes
+ * have none, so read until the end of the file.
+ */
+static char *read_file(int fd, size_t size, const char *path)
+{
+	size_t len = 0, alloc = size + 4096;
+	char *buf;
+	ssize_t ret;
+
+	buf = malloc(alloc);
+	if (!buf)
+		ERROR("malloc");
+
+	while ((ret = read(fd, buf + len, alloc - len - 1)) > 0) {
+		len += ret;
+		if (len + 1 < alloc)
+			continue;
+		alloc *= 2;
+		buf = realloc(buf, alloc);
+		if (!buf)
+			ERROR("realloc");
+	}
+	if (ret < 0)
+		ERROR("read %s", path);
+	buf[len] = '\0';
+
+	return buf;
+}
+
+/*
+ * The chains are built in symbol table order, so the next symbol of a
+ * chain always comes later in the table, which also rules out loops.
+ */
+static int chain_valid(uint32_t next, uint32_t i, uint32_t syms_nr)
+{
+	return !next || (next > i + 1 && next <= syms_nr);
+}
+
+/*
+ * Check that the string offsets and the hash chains of an index file stay
+ * within the index, so a corrupt file can't send the lookups off it.
+ */
+static int symindex_valid(struct symindex *index)
+{
+	struct symindex_header *header = index->header;
+	struct symindex_sym *sym;
+	uint32_t i;
+
+	if (!header->strings_size ||
+	    index->strings[header->strings_size - 1])
+		return 0;
+
+	for (i = 0; i < header->hash_size; i++)
+		if (index->names[i] > header->syms_nr ||
+		    index->locals[i] > header->syms_nr ||
+		    index->colds[i] > header->syms_nr)
+			return 0;
+
+	for (i = 0; i < header->syms_nr; i++) {
+		sym = &index->syms[i];
+		if (sym->name >= header->strings_size ||
+		    sym->file >= header->strings_size ||
+		    !chain_valid(sym->name_next, i, header->syms_nr) ||
+		    !chain_valid(sym->local_next, i, header->syms_nr) ||
+		    !chain_valid(sym->cold_next, i, header->syms_nr))
+			return 0;
+	}
+
+	return 1;
+}
+
+void symindex_open(const char *path, struct symindex *index)
+{
+	struct symindex_header header;
+	struct stat st;
+	ssize_t len;
+	Elf *elf;
+	char *buf;
+	int fd;
+
+	memset(index, 0, sizeof(*index));
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		ERROR("open %s", path);
+
+	if (fstat(fd, &st))
+		ERROR("fstat %s", path);
+
+	len = pread(fd, &header, sizeof(header), 0);
+	if (len >= SELFMAG && !memcmp(&header, ELFMAG, SELFMAG)) {
+		if (elf_version(EV_CURRENT) == EV_NONE)
+			ERROR("elf_version");
+		elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
+		if (!elf)
+			ERROR("elf_begin %s: %s", path, elf_errmsg(-1));
+		symindex_build(elf, index);
+		elf_end(elf);
+		close(fd);
+		return;
+	}
+
+	if (len != sizeof(header) ||
+	    memcmp(header.magic, SYMINDEX_MAGIC, sizeof(header.magic))) {
+		buf = read_file(fd, st.st_size, path);
+		close(fd);
+		symindex_build_map(buf, index);
+		free(buf);
+		return;
+	}
+
+	if (header.version != SYMINDEX_VERSION ||
+	    st.st_size != symindex_size(header.syms_nr, header.hash_size,
+					header.strings_size) ||
+	    !header.hash_size || (header.hash_size & (header.hash_size - 1)))
+		ERROR("bad symbol index %s", path);
+
+	index->size = st.st_size;
+	index->buf = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (index->buf == MAP_FAILED)
+		ERROR("mmap %s", path);
+	index->mapped = 1;
+	close(fd);
+
+	symindex_layout(index);
+	if (!symindex_valid(index))
+		ERROR("bad symbol index %s", path);
+}
+
+void symindex_write(struct symindex *index, const char *path)
+{
+	char *buf = index->buf;
+	size_t size = index->size;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		ERROR("open %s", path);
+
+	while (size) {
+		ret = write(fd, buf, size);
+		if (ret <= 0)
+			ERROR("write %s", path);
+		buf += ret;
+		size -= ret;
+	}
+
+	if (close(fd))
+		ERROR("close %s", path);
+}
+
+void symindex_close(struct symindex *index)
+{
+	if (index->mapped)
+		munmap(index->buf, index->size);
+	else
+		free(index->buf);
+	memset(index, 0, sizeof(*index));
+}
+
+struct symindex_sym *symindex_find(struct symindex *index, const char *name,
+				   struct symindex_sym *prev)
+{
+	struct symindex_sym *sym;
+	uint32_t i;
+
+	i = prev ? prev->name_next :
+	    index->names[sym_hash(NULL, name, -1) &
+			 (index->header->hash_size - 1)];
+	for (; i; i = sym->name_next) {
+		sym = &index->syms[i - 1];
+		if (!strcmp(symindex_name(index, sym), name))
+			return sym;
+	}
+
+	return NULL;
+}
+
+struct symindex_sym *symindex_find_local(struct symindex *index,
+					 const char *file, const char *name,
+					 struct symindex_sym *prev)
+{
+	struct symindex_sym *sym;
+	uint32_t i;
+
+	i = prev ? prev->local_next :
+	    index->locals[sym_hash(file, name, -1) &
+			  (index->header->hash_size - 1)];
+	for (; i; i = sym->local_next) {
+		sym = &index->syms[i - 1];
+		if (!strcmp(index->strings + sym->file, file) &&
+		    !strcmp(symindex_name(index, sym), name))
+			return sym;
+	}
+
+	return NULL;
+}
+
+struct symindex_sym *symindex_find_cold(struct symindex *index,
+					const char *file, const char *name,
+					struct symindex_sym *prev)
+{
+	struct symindex_sym *sym;
+	size_t len = strlen(name);
+	uint32_t i;
+
+	i = prev ? prev->cold_next :
+	    index->colds[sym_hash(file, name, len) &
+			 (index->header->hash_size - 1)];
+	for (; i; i = sym->cold_next) {
+		sym = &index->syms[i - 1];
+		if (!strcmp(index->strings + sym->file, file) &&
+		    cold_parent_len(symindex_name(index, sym)) == len &&
+		    !strncmp(symindex_name(index, sym), name, len))
+			return sym;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,108 @@
+/*
+ * symindex.h
+ *
+ * Copyright (C) 2014 Seth Jennings <sjenning@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA,
+ * 02110-1301, USA.
+ *
+ * Symbol index of a base vmlinux, for the tools which look up the
+ * addresses of the functions and variables a patch module refers to.
+ */
+
+#ifndef _SYMINDEX_H_
+#define _SYMINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The index file is the header, followed by the symbols, the three hash
+ * tables and the string table.  Hash table buckets and chains hold symbol
+ * indexes plus one, with zero ending a chain.  The file is in host byte
+ * order and is only meant to be used on the machine it was built on.
+ */
+#define SYMINDEX_MAGIC		"KPSYMIDX"
+#define SYMINDEX_VERSION	1
+
+struct symindex_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t syms_nr;
+	uint32_t hash_size;	/* buckets per hash table, a power of two */
+	uint32_t strings_size;
+};
+
+#define SYMINDEX_EXPORTED	0x1	/* there's a __kstrtab_ for the name */
+
+struct symindex_sym {
+	uint64_t addr;
+	uint64_t size;
+	uint32_t name;		/* string table offsets */
+	uint32_t file;		/* the preceding STT_FILE symbol, or 0 */
+	uint32_t name_next;	/* all symbols, by name */
+	uint32_t local_next;	/* local symbols, by file and name */
+	uint32_t cold_next;	/* cold parts, by file and parent name */
+	uint8_t info;
+	uint8_t flags;
+	uint16_t pad;
+};
+
+struct symindex {
+	void *buf;
+	size_t size;
+	int mapped;
+	struct symindex_header *header;
+	struct symindex_sym *syms;
+	uint32_t *names, *locals, *colds;
+	char *strings;
+};
+
+/*
+ * Open an index file, or build the index of an ELF file in memory.  Errors
+ * are fatal.
+ */
+void symindex_open(const char *path, struct symindex *index);
+void symindex_write(struct symindex *index, const char *path);
+void symindex_close(struct symindex *index);
+
+/*
+ * Iterate over the symbols with a name, over the local symbols with a name
+ * in a file, and over the cold parts of a function in a file.  Pass NULL
+ * to get the first match, then the previous match to get the next one.
+ * The symbols come in symbol table order.
+ */
+struct symindex_sym *symindex_find(struct symindex *index, const char *name,
+				   struct symindex_sym *prev);
+struct symindex_sym *symindex_find_local(struct symindex *index,
+					 const char *file, const char *name,
+					 struct symindex_sym *prev);
+struct symindex_sym *symindex_find_cold(struct symindex *index,
+					const char *file, const char *name,
+					struct symindex_sym *prev);
+
+static inline char *symindex_name(struct symindex *index,
+				  struct symindex_sym *sym)
+{
+	return index->strings + sym->name;
+}
+
+/*
+ * Return the length of the parent function name if name is the cold part
+ * of a function split by GCC, i.e. "foo.cold" or "foo.cold.N", else 0.
+ */
+size_t cold_parent_len(const char *name);
+
+#endif /* _SYMINDEX_H_ */
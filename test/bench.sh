@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Time create-diff-object on a synthetic object pair generated by
+# benchgen.sh and report its throughput.
+#
+# All options other than -n are passed through to benchgen.sh.
+
+RUNS=5
+GENOPTS=()
+
+usage() {
+	echo "usage: $0 [-n runs] [-f functions] [-r relas/function] [-s statics] [-l strings] [-c percent changed]" >&2
+	exit 1
+}
+
+while getopts "n:f:r:s:l:c:" opt; do
+	case "$opt" in
+		n) RUNS="$OPTARG" ;;
+		f|r|s|l|c) GENOPTS+=("-$opt" "$OPTARG") ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+[[ $# -ne 0 ]] && usage
+
+if [[ ! -e ../kpatch-build/create-diff-object ]]
+then
+	make -C ../kpatch-build create-diff-object || exit 1
+fi
+
+BENCHDIR="$(mktemp -d bench-XXXXXX)" || exit 1
+trap 'rm -rf "$BENCHDIR"' EXIT INT TERM
+
+./benchgen.sh "${GENOPTS[@]}" "$BENCHDIR" || exit 1
+
+FUNCS="$(grep -c '^int bench_func_[0-9]*(int x)$' "$BENCHDIR/orig.c")"
+CHANGED="$(diff "$BENCHDIR/orig.c" "$BENCHDIR/patched.c" | grep -c '^>')"
+ORIGSIZE="$(stat -c %s "$BENCHDIR/orig.o")"
+PATCHEDSIZE="$(stat -c %s "$BENCHDIR/patched.o")"
+
+TIMES=()
+for ((i = 0; i < RUNS; i++)); do
+	START="$(date +%s%N)"
+	../kpatch-build/create-diff-object "$BENCHDIR/orig.o" "$BENCHDIR/patched.o" \
+		"$BENCHDIR/output.o" > /dev/null 2>&1
+	RET=$?
+	END="$(date +%s%N)"
+	if [[ $RET -ne 0 ]]; then
+		echo "create-diff-object failed with exit code $RET"
+		exit 1
+	fi
+	TIMES+=($((END - START)))
+done
+
+echo "functions: $FUNCS ($CHANGED changed)"
+echo "input: $((ORIGSIZE / 1024)) KB original, $((PATCHEDSIZE / 1024)) KB patched"
+echo "output: $(($(stat -c %s "$BENCHDIR/output.o") / 1024)) KB"
+printf '%s\n' "${TIMES[@]}" | awk -v funcs="$FUNCS" \
+	-v bytes="$((ORIGSIZE + PATCHEDSIZE))" -v runs="$RUNS" '
+	NR == 1 || $1 < best { best = $1 }
+	{ total += $1 }
+	END {
+		mean = total / runs / 1e9
+		best /= 1e9
+		printf "create-diff-object: best %.3fs, mean %.3fs over %d runs\n",
+		       best, mean, runs
+		printf "throughput: %.0f functions/s, %.1f MB/s\n",
+		       funcs / best, bytes / best / (1024 * 1024)
+	}'
@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Generate a synthetic original/patched object pair for benchmarking
+# create-diff-object.
+#
+# The generated translation unit contains a configurable number of global
+# functions.  Each function makes a number of relocations (alternating calls
+# to other generated functions and references to generated global data),
+# and static locals and string literals are distributed evenly across the
+# functions.  In the patched version, the requested percentage of functions
+# has its return value changed.
+
+FUNCS=1000
+RELAS=4
+STATICS=100
+STRINGS=500
+CHANGED=10
+
+usage() {
+	echo "usage: $0 [-f functions] [-r relas/function] [-s statics] [-l strings] [-c percent changed] <outdir>" >&2
+	exit 1
+}
+
+while getopts "f:r:s:l:c:" opt; do
+	case "$opt" in
+		f) FUNCS="$OPTARG" ;;
+		r) RELAS="$OPTARG" ;;
+		s) STATICS="$OPTARG" ;;
+		l) STRINGS="$OPTARG" ;;
+		c) CHANGED="$OPTARG" ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+[[ $# -ne 1 ]] && usage
+OUTDIR="$1"
+
+[[ "$FUNCS" -gt 0 ]] || usage
+[[ "$CHANGED" -ge 0 && "$CHANGED" -le 100 ]] || usage
+
+FLAGS="-fno-strict-aliasing -fno-common -fno-delete-null-pointer-checks -O2 -m64 -mpreferred-stack-boundary=4 -mtune=generic -mno-red-zone -mcmodel=kernel -funit-at-a-time -maccumulate-outgoing-args -fno-asynchronous-unwind-tables -fno-stack-protector -fno-omit-frame-pointer -fno-optimize-sibling-calls -fno-strict-overflow -fconserve-stack -ffunction-sections -fdata-sections -fno-inline -fno-pie"
+
+generate() {
+	awk -v funcs="$FUNCS" -v relas="$RELAS" -v statics="$STATICS" \
+	    -v strings="$STRINGS" -v changed="$CHANGED" -v patched="$1" '
+	function is_changed(i) {
+		return patched && (i * changed) % 100 < changed
+	}
+	BEGIN {
+		print "extern int printk(const char *fmt, ...);\n"
+		for (i = 0; i < funcs; i++)
+			printf "int bench_func_%d(int x);\n", i
+		print ""
+		for (i = 0; i < funcs; i++)
+			printf "int bench_data_%d = %d;\n", i, i
+		print ""
+		for (i = 0; i < funcs; i++) {
+			printf "int bench_func_%d(int x)\n{\n", i
+			for (j = i; j < statics; j += funcs)
+				printf "\tstatic int count_%d;\n", j
+			print "\tint ret = x;\n"
+			for (r = 0; r < relas; r++) {
+				if (r % 2)
+					printf "\tret += bench_data_%d;\n", (i + r) % funcs
+				else
+					printf "\tret += bench_func_%d(ret);\n", (i * 7 + r + 1) % funcs
+			}
+			for (j = i; j < statics; j += funcs)
+				printf "\tret += count_%d++;\n", j
+			for (j = i; j < strings; j += funcs)
+				printf "\tprintk(\"bench string %d: %%d\\n\", ret);\n", j
+			printf "\n\treturn ret + %d;\n}\n\n", is_changed(i) ? 2 : 1
+		}
+	}'
+}
+
+mkdir -p "$OUTDIR" || exit 1
+generate 0 > "$OUTDIR/orig.c" || exit 1
+generate 1 > "$OUTDIR/patched.c" || exit 1
+gcc $FLAGS -c "$OUTDIR/orig.c" -o "$OUTDIR/orig.o" || exit 1
+gcc $FLAGS -c "$OUTDIR/patched.c" -o "$OUTDIR/patched.o" || exit 1
@@ -0,0 +1,83 @@
+#!/bin/bash
+#
+# Check that the symbol index is built right from the System.map, kallsyms
+# and nm symbol listings, read from a pipe like /proc/kallsyms, which has no
+# file size, and that kpatch-link finds the patched functions in each.  A
+# local function is looked up in its source file, or among the symbols of
+# no file when the listing has no source files.
+
+if [[ ! -e ../kpatch-build/kpatch-link ]]
+then
+	make -C ../kpatch-build kpatch-link create-symbol-index || exit 1
+fi
+
+SYMDIR="$(mktemp -d symbols-XXXXXX)" || exit 1
+trap 'rm -rf "$SYMDIR"' EXIT INT TERM
+
+# the patch module object, with a local and a global patched function
+cat > "$SYMDIR/file.c" << EOF
+static void __attribute__((noinline, used)) local_func(void) { asm(""); }
+void global_func(void) { local_func(); }
+EOF
+(cd "$SYMDIR" && gcc -O2 -fno-pie -c file.c -o output.o) || exit 1
+
+cat > "$SYMDIR/System.map" << EOF
+ffffffff81000000 T _text
+ffffffff81000100 t local_func
+ffffffff81000140 T global_func
+ffffffff81000200 t other_func
+ffffffff81000300 T _etext
+EOF
+
+cat > "$SYMDIR/kallsyms" << EOF
+ffffffff81000000 T _text
+ffffffff81000100 t local_func
+ffffffff81000140 T global_func
+ffffffff81000200 t other_func
+ffffffff81000300 T _etext
+ffffffffa0000000 t local_func	[module]
+ffffffffa0000100 T global_func	[module]
+EOF
+
+cat > "$SYMDIR/nm" << EOF
+0000000000000000 a other.c
+ffffffff81000000 0000000000000040 t local_func
+0000000000000000 a file.c
+ffffffff81000100 0000000000000030 t local_func
+ffffffff81000140 0000000000000020 T global_func
+                 U printk
+EOF
+
+check() {
+	local listing="$1" expected="$2" found
+
+	if ! cat "$SYMDIR/$listing" | ../kpatch-build/create-symbol-index /dev/stdin \
+		"$SYMDIR/$listing.idx" > "$SYMDIR/log" 2>&1
+	then
+		cat "$SYMDIR/log"
+		echo "symbols failed: can't index $listing" && exit 1
+	fi
+
+	cp -f "$SYMDIR/output.o" "$SYMDIR/patch.o"
+	if ! ../kpatch-build/kpatch-link "$SYMDIR/patch.o" "$SYMDIR/$listing.idx" \
+		> "$SYMDIR/log" 2>&1
+	then
+		cat "$SYMDIR/log"
+		echo "symbols failed: kpatch-link failed with $listing" && exit 1
+	fi
+
+	found="$(awk '/^found patched function / { name = $4 }
+		      /^original function at address / { print name, $5, $7 }' "$SYMDIR/log" |
+		 sort | tr -d ')' | paste -sd ' ')"
+	if [[ "$found" != "$expected" ]]
+	then
+		cat "$SYMDIR/log"
+		echo "symbols failed: found $found with $listing, expected $expected" && exit 1
+	fi
+}
+
+check System.map "global_func ffffffff81000140 192 local_func ffffffff81000100 64"
+check kallsyms "global_func ffffffff81000140 192 local_func ffffffff81000100 64"
+check nm "global_func ffffffff81000140 32 local_func ffffffff81000100 48"
+
+echo "symbols passed"
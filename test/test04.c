@@ -0,0 +1,26 @@
+#include <stdio.h>
+
+void warn_slowpath_null(const char *file, const int line);
+
+#define WARN_ON(condition) ({						\
+	int __ret_warn_on = !!(condition);				\
+	if (__ret_warn_on)						\
+		warn_slowpath_null(__FILE__, __LINE__);			\
+	__ret_warn_on;							\
+})
+
+void test_func() {
+	printf("this is before\n");
+}
+
+void test_func2(int x) {
+	WARN_ON(x);
+}
+
+/*
+ * This test case ensures that functions whose only difference is a
+ * __LINE__ immediate, caused by lines being added earlier in the file,
+ * aren't considered changed.
+ *
+ * Verification points: test_func bundle is included, test_func2 is not.
+ */
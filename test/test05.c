@@ -0,0 +1,17 @@
+#include <stdio.h>
+
+void test_func() {
+	printf("this is before\n");
+}
+
+void test_func2() {
+	printf("this is unchanged\n");
+}
+
+/*
+ * This test case ensures that functions which only refer to string
+ * literals that moved within a merged string section, because a string
+ * was added earlier in the section, aren't considered changed.
+ *
+ * Verification points: test_func bundle is included, test_func2 is not.
+ */
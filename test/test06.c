@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+int test_func(void) {
+	static int count;
+	printf("this is before\n");
+	return count++;
+}
+
+int test_func2(void) {
+	static int count;
+	return count++;
+}
+
+/*
+ * This test case ensures that function-local statics are correlated even
+ * when the numeric suffixes GCC gives them change, because a static of
+ * the same name was added elsewhere in the file.
+ *
+ * Verification points: test_func bundle is included and refers to the
+ * original count.1, test_func2 is not included.
+ */
@@ -0,0 +1,23 @@
+#include <stdio.h>
+
+void die(const char *msg) __attribute__((cold, noreturn));
+
+int test_func(int x) {
+	return x * 2;
+}
+
+int test_func2(int x) {
+	if (x < 0)
+		die("this is before");
+	return x + 1;
+}
+
+/*
+ * This test case ensures that a function and the cold part GCC splits off
+ * from it are treated as a unit.  Only the cold part of test_func2
+ * changes, but test_func2 has to be replaced with it, and test_func2.cold
+ * mustn't be reported as a changed function by itself.
+ *
+ * Verification points: test_func2 bundle is included along with
+ * test_func2.cold in its own section, test_func is not.
+ */
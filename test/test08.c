@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+struct static_key {
+	int enabled;
+};
+
+struct static_key test_key;
+
+static inline __attribute__((always_inline)) int static_branch(struct static_key *key)
+{
+	asm goto("1:"
+		".byte 0x0f,0x1f,0x44,0x00,0x00\n\t"
+		".pushsection __jump_table, \"aw\"\n\t"
+		".balign 8\n\t"
+		".quad 1b, %l[l_yes], %c0\n\t"
+		".popsection\n\t"
+		: : "i" (key) : : l_yes);
+	return 0;
+l_yes:
+	return 1;
+}
+
+void test_func() {
+	if (static_branch(&test_key))
+		printf("this is before\n");
+}
+
+void test_func2() {
+	if (static_branch(&test_key))
+		printf("this is unchanged\n");
+}
+
+/*
+ * This test case ensures that the __jump_table entries of a changed
+ * function are carried into the output, so its static branches can still
+ * be patched, and that the entries for unchanged functions are dropped.
+ *
+ * Verification points: test_func bundle is included along with a
+ * __jump_table containing only its entry, test_func2 is not.
+ */
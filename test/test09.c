@@ -0,0 +1,47 @@
+#include <stdio.h>
+
+#define alternative(oldinstr, newinstr)					\
+	asm volatile("661:\n\t" oldinstr "\n662:\n"			\
+		".pushsection .altinstructions,\"a\"\n"			\
+		" .long 661b - .\n"					\
+		" .long 663f - .\n"					\
+		" .word 0x1234\n"					\
+		" .byte 662b-661b\n"					\
+		" .byte 664f-663f\n"					\
+		".popsection\n"						\
+		".pushsection .altinstr_replacement, \"ax\"\n"		\
+		"663:\n\t" newinstr "\n664:\n"				\
+		".popsection" : : : "memory")
+
+#define paravirt_site(instr)						\
+	asm volatile("771:\n\t" instr "\n772:\n"			\
+		".pushsection .parainstructions,\"a\"\n"		\
+		" .balign 8\n"						\
+		" .quad 771b\n"						\
+		" .byte 1\n"						\
+		" .byte 772b-771b\n"					\
+		" .short 0\n"						\
+		".popsection" : : : "memory")
+
+void test_func() {
+	alternative("nop", "lfence");
+	paravirt_site("cli");
+	printf("this is before\n");
+}
+
+void test_func2() {
+	alternative("nop", "mfence");
+	paravirt_site("sti");
+	printf("this is unchanged\n");
+}
+
+/*
+ * This test case ensures that the .altinstructions and .parainstructions
+ * entries of a changed function are carried into the output, along with
+ * the replacement instructions, and that the entries for unchanged
+ * functions are dropped.
+ *
+ * Verification points: test_func bundle is included along with its
+ * .altinstructions and .parainstructions entries and
+ * .altinstr_replacement, test_func2 is not.
+ */
@@ -0,0 +1,18 @@
+void __might_sleep(const char *file, int line, int preempt_offset);
+int printk(const char *fmt, ...);
+
+void test_func() {
+	printk("value %d\n", 100);
+}
+
+void test_func2() {
+	__might_sleep(__FILE__, __LINE__, 1);
+}
+
+/*
+ * This test case ensures that changes to the arguments of line number
+ * functions other than the line number, and to the arguments of functions
+ * which don't take a line number, aren't mistaken for __LINE__ changes.
+ *
+ * Verification points: test_func and test_func2 bundles are included.
+ */
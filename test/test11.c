@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+/* test flags: -fno-function-sections -fno-data-sections */
+
+void test_func() {
+	printf("this is before\n");
+}
+
+void test_func3() {
+	printf("this is unchanged\n");
+}
+
+/*
+ * This test case is test03 built without -ffunction-sections and
+ * -fdata-sections, so that test_func(), test_func2() and test_func3() are
+ * all in .text and the call to the new static test_func2() is resolved by
+ * the assembler rather than with a rela.
+ *
+ * Verification points: bundles for test_func() and test_func2() should be
+ * included, and the call should be made with a rela to test_func2.
+ */
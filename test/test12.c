@@ -0,0 +1,21 @@
+#include <stdio.h>
+
+static int test_count __attribute__((used, section(".data..percpu")));
+
+void test_func() {
+	printf("this is before\n");
+}
+
+void test_func2() {
+	printf("this is unchanged\n");
+}
+
+/*
+ * This test case adds statics in sections named with the section
+ * attribute, a per-CPU variable and a dynamic debug style descriptor.  The
+ * module loader finds such sections by name, so they have to keep their
+ * names rather than being split up like .data.
+ *
+ * Verification points: test_func bundle is included with .data..percpu and
+ * __verbose, test_func2 is not.
+ */
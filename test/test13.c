@@ -0,0 +1,15 @@
+void __might_sleep(const char *file, int line, int preempt_offset);
+
+void test_func() {
+	asm volatile("movl $100, %%r14d" : : : "r14");
+	__might_sleep(__FILE__, __LINE__, 1);
+}
+
+/*
+ * This test case ensures that a changed immediate loaded into another
+ * register before a line number function, here "mov $imm32, %r14d" which
+ * only differs from "mov $imm32, %esi" by its REX prefix, isn't mistaken
+ * for a __LINE__ change.
+ *
+ * Verification points: test_func bundle is included.
+ */
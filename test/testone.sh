@@ -8,6 +8,8 @@ fi
 
 TESTCASE=$1
 FLAGS="-fno-strict-aliasing -fno-common -fno-delete-null-pointer-checks -O2 -m64 -mpreferred-stack-boundary=4 -mtune=generic -mno-red-zone -mcmodel=kernel -funit-at-a-time -maccumulate-outgoing-args -fno-asynchronous-unwind-tables -fno-stack-protector -fno-omit-frame-pointer -fno-optimize-sibling-calls -fno-strict-overflow -fconserve-stack -ffunction-sections -fdata-sections -fno-inline"
+# a test can add its own flags with a "/* test flags: ... */" line
+FLAGS="$FLAGS $(sed -n 's|^/\* test flags: \(.*\) \*/$|\1|p' $TESTCASE.c)"
 CFLAGS="$FLAGS" make $TESTCASE.o > /dev/null 2>&1 || exit 1
 mv -f $TESTCASE.o $TESTCASE.o.orig
 patch $TESTCASE.c $TESTCASE.patch > /dev/null 2>&1 || exit 1
@@ -17,6 +19,52 @@ then
 	make -C ../kpatch-build create-diff-object || exit 1
 fi
 ../kpatch-build/create-diff-object -i $TESTCASE.o.orig $TESTCASE.o output.o > /dev/null 2>&1 || exit 1
+# the output must be reproducible byte for byte
+../kpatch-build/create-diff-object $TESTCASE.o.orig $TESTCASE.o output2.o > /dev/null 2>&1 || exit 1
+if ! cmp -s output.o output2.o
+then
+	echo "$TESTCASE failed: output differs between runs" && exit 1
+fi
+rm -f output2.o > /dev/null 2>&1
+# and the same from the fingerprints of the original object
+../kpatch-build/create-diff-object --fingerprint $TESTCASE.o.orig $TESTCASE.fp > /dev/null 2>&1 || exit 1
+../kpatch-build/create-diff-object --base-fingerprint=$TESTCASE.fp $TESTCASE.o output2.o > /dev/null 2>&1 || exit 1
+if ! cmp -s output.o output2.o
+then
+	echo "$TESTCASE failed: output differs when diffed from fingerprints" && exit 1
+fi
+rm -f output2.o $TESTCASE.fp > /dev/null 2>&1
+# the output must link like any other object
+if ! ld -r -o linked.o output.o > /dev/null 2>&1
+then
+	echo "$TESTCASE failed: output doesn't link" && exit 1
+fi
+rm -f linked.o > /dev/null 2>&1
+# and so must the output of kpatch-link, against the original object
+# linked at kernel addresses, with the symbols it leaves undefined in the
+# map too.  kpatch-link can only replace functions, so skip the tests
+# which add new ones.
+if [[ ! -e ../kpatch-build/kpatch-link ]]
+then
+	make -C ../kpatch-build kpatch-link || exit 1
+fi
+NEWFUNCS="$(comm -13 <(nm --defined-only $TESTCASE.o.orig | awk '$2 ~ /[Tt]/ { print $3 }' | sort) \
+	<(nm --defined-only output.o | awk '$2 ~ /[Tt]/ { print $3 }' | sort))"
+if [[ -z "$NEWFUNCS" ]]
+then
+	ld -o vmlinux.o -Ttext=0xffffffff81000000 -e 0 --unresolved-symbols=ignore-all $TESTCASE.o.orig > /dev/null 2>&1 || exit 1
+	nm -a -p -S vmlinux.o | grep -v " U " > System.map
+	nm -u output.o | awk '{ print $2 }' | grep -vxF -f <(awk '{ print $NF }' System.map) |
+		awk '{ print "ffffffff82000000 T " $1 }' >> System.map
+	../kpatch-build/create-symbol-index System.map symbols.idx > /dev/null 2>&1 || exit 1
+	cp output.o patch.o
+	../kpatch-build/kpatch-link patch.o symbols.idx > /dev/null 2>&1 || exit 1
+	if ! ld -r -o linked.o patch.o > /dev/null 2>&1
+	then
+		echo "$TESTCASE failed: kpatch-link output doesn't link" && exit 1
+	fi
+	rm -f vmlinux.o System.map symbols.idx patch.o linked.o > /dev/null 2>&1
+fi
 rm -f $TESTCASE.o $TESTCASE.o.orig > /dev/null 2>&1
 patch -R $TESTCASE.c $TESTCASE.patch > /dev/null 2>&1 || echo "warning: unable to unpatch file $TESTCASE.c"
 
@@ -0,0 +1,43 @@
+#!/bin/bash
+#
+# Check that create-diff-object handles objects with more sections than fit
+# in the ELF header (extended section numbering, SHN_XINDEX), using an
+# object pair generated by benchgen.sh, and that its output links.
+
+# each function has its own text, rela and data section
+FUNCS=22000
+
+if [[ ! -e ../kpatch-build/create-diff-object ]]
+then
+	make -C ../kpatch-build create-diff-object || exit 1
+fi
+
+XINDEXDIR="$(mktemp -d xindex-XXXXXX)" || exit 1
+trap 'rm -rf "$XINDEXDIR"' EXIT INT TERM
+
+./benchgen.sh -f $FUNCS -r 2 -s 0 -l 0 -c 1 "$XINDEXDIR" || exit 1
+
+SECTIONS="$(readelf -h "$XINDEXDIR/orig.o" |
+	    sed -n 's/^ *Number of section headers: *0 (\([0-9]*\))$/\1/p')"
+if [[ -z "$SECTIONS" || "$SECTIONS" -lt 65280 ]]
+then
+	echo "xindex failed: object doesn't use extended section numbering" && exit 1
+fi
+
+../kpatch-build/create-diff-object -i "$XINDEXDIR/orig.o" "$XINDEXDIR/patched.o" \
+	"$XINDEXDIR/output.o" > "$XINDEXDIR/log" 2>&1 || {
+	cat "$XINDEXDIR/log"
+	echo "xindex failed: create-diff-object failed" && exit 1
+}
+
+CHANGED="$(diff "$XINDEXDIR/orig.c" "$XINDEXDIR/patched.c" | grep -c '^>')"
+if [[ "$(grep -c '^changed function: ' "$XINDEXDIR/log")" -ne $CHANGED ]]
+then
+	cat "$XINDEXDIR/log"
+	echo "xindex failed: expected $CHANGED changed functions" && exit 1
+fi
+
+if ! ld -r -o "$XINDEXDIR/linked.o" "$XINDEXDIR/output.o" > /dev/null 2>&1
+then
+	echo "xindex failed: output doesn't link" && exit 1
+fi